@@ -139,6 +139,58 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
   block->write_cnt++;
 }
 
+/* Reads CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Uses a single multi-sector transfer if the driver
+   supports one.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                     void *buffer)
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  if (block->ops->read_multiple != NULL)
+    block->ops->read_multiple (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->read (block->aux, sector + i,
+                        (uint8_t *) buffer + i * BLOCK_SECTOR_SIZE);
+  block->read_cnt += cnt;
+}
+
+/* Writes CNT consecutive sectors starting at SECTOR to BLOCK from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Uses a single multi-sector transfer if the driver supports
+   one.  Returns after the block device has acknowledged
+   receiving all of the data.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                      const void *buffer)
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  if (block->ops->write_multiple != NULL)
+    block->ops->write_multiple (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->write (block->aux, sector + i,
+                         (const uint8_t *) buffer + i * BLOCK_SECTOR_SIZE);
+  block->write_cnt += cnt;
+}
+
 /* Returns the number of sectors in BLOCK. */
 block_sector_t
 block_size (struct block *block)
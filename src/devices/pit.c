@@ -11,9 +11,6 @@
 #define PIT_PORT_CONTROL          0x43                /* Control port. */
 #define PIT_PORT_COUNTER(CHANNEL) (0x40 + (CHANNEL))  /* Counter port. */
 
-/* PIT cycles per second. */
-#define PIT_HZ 1193180
-
 /* Configure the given CHANNEL in the PIT.  In a PC, the PIT's
    three output channels are hooked up like this:
 
@@ -81,3 +78,63 @@ pit_configure_channel (int channel, int mode, int frequency)
   outb (PIT_PORT_COUNTER (channel), count >> 8);
   intr_set_level (old_level);
 }
+
+/* Starts CHANNEL counting down COUNT PIT cycles in mode 0,
+   "interrupt on terminal count": the channel's output goes low
+   now and rises when the count reaches 0, then stays high.
+   Hooked up to an interrupt controller, this generates a single
+   interrupt after COUNT cycles.  A COUNT of 0 means 65536.
+   pit_configure_channel() returns the channel to periodic
+   operation. */
+void
+pit_start_oneshot (int channel, uint16_t count)
+{
+  enum intr_level old_level;
+
+  ASSERT (channel == 0 || channel == 2);
+
+  old_level = intr_disable ();
+  outb (PIT_PORT_CONTROL, (channel << 6) | 0x30);
+  outb (PIT_PORT_COUNTER (channel), count);
+  outb (PIT_PORT_COUNTER (channel), count >> 8);
+  intr_set_level (old_level);
+}
+
+/* Returns the current value of CHANNEL's counter, that is, the
+   number of PIT cycles left in the current period or count. */
+uint16_t
+pit_read_count (int channel)
+{
+  enum intr_level old_level;
+  uint16_t count;
+
+  ASSERT (channel == 0 || channel == 2);
+
+  /* Latch the counter, then read it low byte first. */
+  old_level = intr_disable ();
+  outb (PIT_PORT_CONTROL, channel << 6);
+  count = inb (PIT_PORT_COUNTER (channel));
+  count |= inb (PIT_PORT_COUNTER (channel)) << 8;
+  intr_set_level (old_level);
+  return count;
+}
+
+/* Returns the state of CHANNEL's output.  After
+   pit_start_oneshot(), the output is high once the count has
+   expired. */
+bool
+pit_output_high (int channel)
+{
+  enum intr_level old_level;
+  uint8_t status;
+
+  ASSERT (channel == 0 || channel == 2);
+
+  /* Read-back command latching only CHANNEL's status byte, whose
+     top bit is the output. */
+  old_level = intr_disable ();
+  outb (PIT_PORT_CONTROL, 0xe0 | (2 << channel));
+  status = inb (PIT_PORT_COUNTER (channel));
+  intr_set_level (old_level);
+  return (status & 0x80) != 0;
+}
@@ -8,10 +8,17 @@
 #include "threads/thread.h"
 #ifdef USERPROG
 #include "userprog/exception.h"
+#include "userprog/pagedir.h"
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
+#include "filesys/inode.h"
+#endif
+#ifdef VM
+#include "devices/swap.h"
+#include "vm/frame.h"
 #endif
 
 /* Keyboard control register port. */
@@ -124,10 +131,17 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
+  cache_print_stats ();
+  inode_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
 #ifdef USERPROG
   exception_print_stats ();
+  pagedir_print_stats ();
+#endif
+#ifdef VM
+  frame_print_stats ();
+  swap_print_stats ();
 #endif
 }
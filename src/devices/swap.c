@@ -1,10 +1,15 @@
 #include "devices/swap.h"
 #include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <lz.h>
+#include <round.h>
 #include <stdio.h>
+#include <string.h>
 
 /* Pointer to the swap device */
 static struct block *swap_device;
@@ -12,16 +17,102 @@ static struct block *swap_device;
 /* Pointer to a bitmap to track used swap pages */
 static struct bitmap *swap_bitmap;
 
-/* Lock that protects swap_bitmap from unsynchronised access */
+/* Number of SPT entries referring to each swap slot. A slot is shared
+   when a process forks, and freed when its last reference is dropped */
+static uint16_t *slot_refs;
+
+/* Pages read ahead from swap, waiting to be faulted in. An entry is
+   reserved for its slot before the read is issued, with a nonzero
+   FILL tag, and only takes the data if it still holds the same
+   reservation once the read completes: the slot may have been dropped,
+   or the entry reused, meanwhile */
+struct swap_cache_entry
+  {
+    size_t slot;                /* Slot cached, or BITMAP_ERROR if unused */
+    unsigned fill;              /* Reservation awaiting data, 0 once filled */
+    uint8_t *page;              /* Copy of the slot's page */
+  };
+
+#define SWAP_CACHE_PAGES 8
+static struct swap_cache_entry swap_cache[SWAP_CACHE_PAGES];
+static size_t cache_hand;       /* Next entry to replace, round robin */
+static unsigned next_fill;      /* Tag for the next reservation */
+
+/* Lock that protects swap_bitmap, slot_refs and swap_cache from
+   unsynchronised access */
 static struct lock swap_lock;
 
+/* Buffer for multi-page transfers, and the lock serialising its use.
+   Taken before swap_lock when both are held */
+static uint8_t *cluster_buffer;
+static struct lock cluster_lock;
+
+/* Compressed swap pool (zswap), enabled with the -zswap option.
+   Pages being swapped out are first compressed into this pool of
+   kernel pages, and only go to the swap device if the pool is full or
+   they don't compress well enough. A compressed page takes a run of
+   ZSWAP_BLOCK_SIZE byte blocks, and has a slot number following the
+   device's slots, so that callers needn't tell the two apart.
+   Protected by swap_lock, except for the compression scratch memory,
+   which is protected by zswap_lock, taken before swap_lock */
+#define ZSWAP_BLOCK_SIZE 64
+#define ZSWAP_SLOTS_PER_PAGE 16           /* Compressed pages per pool page, at most */
+#define ZSWAP_MAX_SIZE (PGSIZE * 3 / 4)   /* Pages compressing to more go to the device */
+
+/* A compressed page in the pool */
+struct zswap_object
+  {
+    uint32_t block;             /* First block in zswap_pool */
+    uint16_t size;              /* Compressed size in bytes */
+  };
+
+static uint8_t *zswap_pool;
+static size_t zswap_pages;                /* Pool size in pages, 0 if disabled */
+static struct bitmap *zswap_blocks;       /* Blocks of zswap_pool in use */
+static struct bitmap *zswap_slots;        /* Compressed page slots in use */
+static struct zswap_object *zswap_objects; /* Indexed by slot less disk_slot_cnt */
+static size_t disk_slot_cnt;              /* Slots on the device, zswap's follow */
+static struct lock zswap_lock;
+static uint8_t *zswap_buffer;             /* Compression output */
+static uint8_t zswap_work[LZ_WORK_SIZE];  /* Compression hash table */
+
 /* Number of sectors needed to store a page */
 #define PAGE_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
 
-/* Sets up the swap space */
+/* Statistics */
+static long long write_cnt;     /* Pages written to swap */
+static long long read_cnt;      /* Pages read from swap */
+static long long cluster_cnt;   /* Multi-page writes */
+static long long readahead_cnt; /* Pages read ahead into the swap cache */
+static long long cache_hit_cnt; /* Page reads served by the swap cache */
+static long long zswap_store_cnt;   /* Pages compressed into zswap */
+static long long zswap_store_bytes; /* Their total compressed size */
+static long long zswap_hit_cnt;     /* Page reads served by zswap */
+static long long zswap_full_cnt;    /* Pages spilled to the device as zswap was full */
+static long long zswap_poor_cnt;    /* Pages spilled as they didn't compress */
+
+static struct swap_cache_entry *cache_find (size_t slot);
+static bool read_cached (void *vaddr, size_t slot);
+static size_t device_out (const void *vaddr);
+static void zswap_init (size_t pages);
+static size_t zswap_store (const void *vaddr);
+static void zswap_load (void *vaddr, size_t slot);
+static void zswap_free (size_t slot);
+
+/* Returns true if SLOT is in the zswap pool rather than the device */
+static inline bool
+is_zswap_slot (size_t slot)
+{
+  return slot >= disk_slot_cnt;
+}
+
+/* Sets up the swap space, with a compressed pool of ZSWAP_POOL_PAGES
+   kernel pages in front of the swap device, or none if 0 */
 void
-swap_init (void) 
+swap_init (size_t zswap_pool_pages) 
 {
+  size_t i;
+
   // locate the swap block allocated to the kernel
   swap_device = block_get_role (BLOCK_SWAP);
   if (swap_device == NULL) {
@@ -35,27 +126,114 @@ swap_init (void)
   if (swap_bitmap == NULL){
     PANIC ("couldn't create swap bitmap");
   }
+  disk_slot_cnt = bitmap_size (swap_bitmap);
+  zswap_init (zswap_pool_pages);
+  // one spare entry, since calloc of zero entries fails when swap is disabled
+  slot_refs = calloc (disk_slot_cnt + zswap_pages * ZSWAP_SLOTS_PER_PAGE + 1,
+                      sizeof *slot_refs);
+  if (slot_refs == NULL){
+    PANIC ("couldn't create swap slot reference counts");
+  }
   lock_init (&swap_lock);
+  lock_init (&cluster_lock);
+  lock_init (&zswap_lock);
+
+  for (i = 0; i < SWAP_CACHE_PAGES; i++)
+    swap_cache[i].slot = BITMAP_ERROR;
+  if (swap_device != NULL) {
+    cluster_buffer = palloc_get_multiple (PAL_ASSERT, SWAP_CLUSTER_PAGES);
+    uint8_t *cache_pages = palloc_get_multiple (PAL_ASSERT, SWAP_CACHE_PAGES);
+    for (i = 0; i < SWAP_CACHE_PAGES; i++)
+      swap_cache[i].page = cache_pages + i * PGSIZE;
+  }
 }
 
 /* Swaps page at VADDR out of memory, returns the swap-slot used */
 size_t
 swap_out (const void *vaddr) 
+{
+  size_t slot = zswap_store (vaddr);
+  if (slot == BITMAP_ERROR)
+    slot = device_out (vaddr);
+  return slot;
+}
+
+/* Swaps the CNT pages at PAGES[], at most SWAP_CLUSTER_PAGES, out of
+   memory, storing the swap-slot used for PAGES[I] in SLOTS[I], or
+   BITMAP_ERROR if swap is full. The pages zswap doesn't take go to a
+   run of consecutive slots on the device, written in a single
+   multi-sector transfer, or one by one if there's no free run long
+   enough */
+void
+swap_out_cluster (void *const pages[], size_t slots[], size_t cnt)
+{
+  const void *spill[SWAP_CLUSTER_PAGES];
+  size_t spill_idx[SWAP_CLUSTER_PAGES];
+  size_t spill_cnt = 0;
+  size_t slot = BITMAP_ERROR;
+  size_t i;
+
+  ASSERT (cnt <= SWAP_CLUSTER_PAGES);
+  for (i = 0; i < cnt; i++)
+    {
+      slots[i] = zswap_store (pages[i]);
+      if (slots[i] == BITMAP_ERROR)
+        {
+          spill[spill_cnt] = pages[i];
+          spill_idx[spill_cnt++] = i;
+        }
+    }
+  if (spill_cnt == 0)
+    return;
+
+  if (spill_cnt > 1)
+    {
+      lock_acquire (&swap_lock);
+      slot = bitmap_scan_and_flip (swap_bitmap, 0, spill_cnt, false);
+      if (slot != BITMAP_ERROR)
+        {
+          for (i = 0; i < spill_cnt; i++)
+            slot_refs[slot + i] = 1;
+          write_cnt += spill_cnt;
+          cluster_cnt++;
+        }
+      lock_release (&swap_lock);
+    }
+  if (slot == BITMAP_ERROR)
+    {
+      for (i = 0; i < spill_cnt; i++)
+        slots[spill_idx[i]] = device_out (spill[i]);
+      return;
+    }
+
+  lock_acquire (&cluster_lock);
+  for (i = 0; i < spill_cnt; i++)
+    memcpy (cluster_buffer + i * PGSIZE, spill[i], PGSIZE);
+  block_write_multiple (swap_device, slot * PAGE_SECTORS, spill_cnt * PAGE_SECTORS,
+                        cluster_buffer);
+  lock_release (&cluster_lock);
+  for (i = 0; i < spill_cnt; i++)
+    slots[spill_idx[i]] = slot + i;
+}
+
+/* Writes the page at VADDR to a free slot on the swap device, returns
+   the slot used, or BITMAP_ERROR if the device is full */
+static size_t
+device_out (const void *vaddr)
 {
   // find available swap-slot for the page to be swapped out
   lock_acquire (&swap_lock);
   size_t slot = bitmap_scan_and_flip (swap_bitmap, 0, 1, false);
+  if (slot != BITMAP_ERROR) {
+    slot_refs[slot] = 1;
+    write_cnt++;
+  }
   lock_release (&swap_lock);
   if (slot == BITMAP_ERROR) 
     return BITMAP_ERROR; 
 
-  // calculate block sector from swap-slot number
-  size_t sector = slot * PAGE_SECTORS;
-  
-  // loop over each sector of the page, copying it from memory into swap
-  for (size_t i = 0; i < PAGE_SECTORS; i++)
-    block_write (swap_device, sector + i, vaddr + i * BLOCK_SECTOR_SIZE);
-
+  // write all the sectors of the page in one transfer
+  block_write_multiple (swap_device, slot * PAGE_SECTORS, PAGE_SECTORS, vaddr);
   return slot;
 }
 
@@ -63,20 +241,282 @@ swap_out (const void *vaddr)
 void
 swap_in (void *vaddr, size_t slot) 
 {
-  // calculate block sector from swap-slot number
-  size_t sector = slot * PAGE_SECTORS;
-
-  // loop over each sector of the page, copying it from swap into memory
-  for (size_t i = 0; i < PAGE_SECTORS; i++)
-    block_read (swap_device, sector + i, vaddr + i * BLOCK_SECTOR_SIZE);
+  swap_read (vaddr, slot);
   
   // clear the swap-slot previously used by this page
   swap_drop (slot);
 }
 
-/* Clears the swap-slot SLOT so that it can be used for another page */
+/* Copies the page in swap-slot SLOT into memory at VADDR, keeping
+   the slot so that the page can later be dropped from memory again
+   without being rewritten, as long as it stays clean */
+void
+swap_read (void *vaddr, size_t slot)
+{
+  lock_acquire (&swap_lock);
+  if (is_zswap_slot (slot))
+    {
+      zswap_load (vaddr, slot);
+      lock_release (&swap_lock);
+      return;
+    }
+  bool cached = read_cached (vaddr, slot);
+  if (!cached)
+    read_cnt++;
+  lock_release (&swap_lock);
+  if (cached)
+    return;
+
+  // read all the sectors of the page in one transfer
+  block_read_multiple (swap_device, slot * PAGE_SECTORS, PAGE_SECTORS, vaddr);
+}
+
+/* Copies the page in swap-slot SLOT into memory at VADDR like
+   swap_read(), and speculatively reads the pages in the following
+   slots, CNT in all and at most SWAP_CLUSTER_PAGES, into the swap
+   cache in the same multi-sector transfer. A later swap_read() of one
+   of them is then served from memory. The caller should only ask for
+   slots it expects to be read soon, such as those holding the next
+   pages of the same process */
+void
+swap_read_cluster (void *vaddr, size_t slot, size_t cnt)
+{
+  struct swap_cache_entry *entries[SWAP_CLUSTER_PAGES];
+  unsigned fills[SWAP_CLUSTER_PAGES];
+  size_t i;
+
+  ASSERT (cnt <= SWAP_CLUSTER_PAGES);
+  if (!is_zswap_slot (slot) && slot + cnt > disk_slot_cnt)
+    cnt = disk_slot_cnt - slot;
+  if (cnt <= 1 || is_zswap_slot (slot))
+    {
+      swap_read (vaddr, slot);
+      return;
+    }
+
+  /* Reserve cache entries for the slots not cached yet */
+  lock_acquire (&swap_lock);
+  if (read_cached (vaddr, slot))
+    {
+      lock_release (&swap_lock);
+      return;
+    }
+  for (i = 1; i < cnt; i++)
+    {
+      entries[i] = NULL;
+      if (slot_refs[slot + i] == 0 || cache_find (slot + i) != NULL)
+        continue;
+      struct swap_cache_entry *e = &swap_cache[cache_hand];
+      cache_hand = (cache_hand + 1) % SWAP_CACHE_PAGES;
+      if (++next_fill == 0)
+        next_fill = 1;
+      e->slot = slot + i;
+      e->fill = next_fill;
+      entries[i] = e;
+      fills[i] = next_fill;
+    }
+  read_cnt += cnt;
+  lock_release (&swap_lock);
+
+  lock_acquire (&cluster_lock);
+  block_read_multiple (swap_device, slot * PAGE_SECTORS, cnt * PAGE_SECTORS,
+                       cluster_buffer);
+  memcpy (vaddr, cluster_buffer, PGSIZE);
+  lock_acquire (&swap_lock);
+  for (i = 1; i < cnt; i++)
+    {
+      struct swap_cache_entry *e = entries[i];
+      if (e != NULL && e->slot == slot + i && e->fill == fills[i])
+        {
+          memcpy (e->page, cluster_buffer + i * PGSIZE, PGSIZE);
+          e->fill = 0;
+          readahead_cnt++;
+        }
+    }
+  lock_release (&swap_lock);
+  lock_release (&cluster_lock);
+}
+
+/* Returns the swap cache entry for SLOT, filled or not, or NULL.
+   Must be called with swap_lock held */
+static struct swap_cache_entry *
+cache_find (size_t slot)
+{
+  size_t i;
+
+  for (i = 0; i < SWAP_CACHE_PAGES; i++)
+    if (swap_cache[i].slot == slot)
+      return &swap_cache[i];
+  return NULL;
+}
+
+/* Copies SLOT's page from the swap cache to VADDR, freeing its entry.
+   Returns false if the page isn't cached.
+   Must be called with swap_lock held */
+static bool
+read_cached (void *vaddr, size_t slot)
+{
+  struct swap_cache_entry *e = cache_find (slot);
+  if (e == NULL || e->fill != 0)
+    return false;
+  memcpy (vaddr, e->page, PGSIZE);
+  e->slot = BITMAP_ERROR;
+  cache_hit_cnt++;
+  return true;
+}
+
+/* Allocates a zswap pool of PAGES kernel pages, or leaves zswap
+   disabled if PAGES is 0 or they can't be had */
+static void
+zswap_init (size_t pages)
+{
+  if (pages == 0)
+    return;
+  zswap_pool = palloc_get_multiple (0, pages);
+  zswap_buffer = palloc_get_page (0);
+  zswap_blocks = bitmap_create (pages * (PGSIZE / ZSWAP_BLOCK_SIZE));
+  zswap_slots = bitmap_create (pages * ZSWAP_SLOTS_PER_PAGE);
+  zswap_objects = calloc (pages * ZSWAP_SLOTS_PER_PAGE, sizeof *zswap_objects);
+  if (zswap_pool == NULL || zswap_buffer == NULL || zswap_blocks == NULL
+      || zswap_slots == NULL || zswap_objects == NULL)
+    {
+      printf ("zswap: couldn't allocate %zu pages--zswap disabled\n", pages);
+      if (zswap_pool != NULL)
+        palloc_free_multiple (zswap_pool, pages);
+      if (zswap_buffer != NULL)
+        palloc_free_page (zswap_buffer);
+      bitmap_destroy (zswap_blocks);
+      bitmap_destroy (zswap_slots);
+      free (zswap_objects);
+      return;
+    }
+  zswap_pages = pages;
+  printf ("zswap: %zu kB compressed swap pool\n", pages * PGSIZE / 1024);
+}
+
+/* Compresses the page at VADDR into the zswap pool, returns the
+   swap-slot used, or BITMAP_ERROR if zswap is disabled or full, or the
+   page doesn't compress to ZSWAP_MAX_SIZE bytes */
+static size_t
+zswap_store (const void *vaddr)
+{
+  size_t slot = BITMAP_ERROR;
+
+  if (zswap_pages == 0)
+    return BITMAP_ERROR;
+  lock_acquire (&zswap_lock);
+  size_t size = lz_compress (vaddr, PGSIZE, zswap_buffer, ZSWAP_MAX_SIZE, zswap_work);
+  lock_acquire (&swap_lock);
+  if (size == 0)
+    zswap_poor_cnt++;
+  else
+    {
+      size_t blocks = DIV_ROUND_UP (size, ZSWAP_BLOCK_SIZE);
+      size_t block = bitmap_scan_and_flip (zswap_blocks, 0, blocks, false);
+      size_t idx = BITMAP_ERROR;
+      if (block != BITMAP_ERROR)
+        idx = bitmap_scan_and_flip (zswap_slots, 0, 1, false);
+      if (idx == BITMAP_ERROR)
+        {
+          if (block != BITMAP_ERROR)
+            bitmap_set_multiple (zswap_blocks, block, blocks, false);
+          zswap_full_cnt++;
+        }
+      else
+        {
+          memcpy (zswap_pool + block * ZSWAP_BLOCK_SIZE, zswap_buffer, size);
+          zswap_objects[idx].block = block;
+          zswap_objects[idx].size = size;
+          slot = disk_slot_cnt + idx;
+          slot_refs[slot] = 1;
+          zswap_store_cnt++;
+          zswap_store_bytes += size;
+        }
+    }
+  lock_release (&swap_lock);
+  lock_release (&zswap_lock);
+  return slot;
+}
+
+/* Decompresses the page in zswap slot SLOT into memory at VADDR.
+   Must be called with swap_lock held */
+static void
+zswap_load (void *vaddr, size_t slot)
+{
+  struct zswap_object *o = &zswap_objects[slot - disk_slot_cnt];
+
+  if (!lz_decompress (zswap_pool + o->block * ZSWAP_BLOCK_SIZE, o->size,
+                      vaddr, PGSIZE))
+    PANIC ("zswap: slot %zu is corrupt", slot);
+  zswap_hit_cnt++;
+}
+
+/* Frees zswap slot SLOT and the blocks it occupies.
+   Must be called with swap_lock held */
+static void
+zswap_free (size_t slot)
+{
+  struct zswap_object *o = &zswap_objects[slot - disk_slot_cnt];
+
+  bitmap_set_multiple (zswap_blocks, o->block,
+                       DIV_ROUND_UP (o->size, ZSWAP_BLOCK_SIZE), false);
+  bitmap_reset (zswap_slots, slot - disk_slot_cnt);
+}
+
+/* Adds a reference to swap-slot SLOT, for a second SPT entry holding
+   the same page */
+void
+swap_dup (size_t slot)
+{
+  lock_acquire (&swap_lock);
+  ASSERT (slot_refs[slot] > 0);
+  slot_refs[slot]++;
+  lock_release (&swap_lock);
+}
+
+/* Drops a reference to swap-slot SLOT, clearing it so that it can be
+   used for another page once nothing refers to it */
 void
 swap_drop (size_t slot)
 {
-  bitmap_reset (swap_bitmap, slot);
+  lock_acquire (&swap_lock);
+  ASSERT (slot_refs[slot] > 0);
+  if (--slot_refs[slot] == 0)
+    {
+      if (is_zswap_slot (slot))
+        zswap_free (slot);
+      else
+        {
+          struct swap_cache_entry *e = cache_find (slot);
+          if (e != NULL)
+            e->slot = BITMAP_ERROR;
+          bitmap_reset (swap_bitmap, slot);
+        }
+    }
+  lock_release (&swap_lock);
+}
+
+/* Prints swap statistics */
+void
+swap_print_stats (void)
+{
+  printf ("Swap: %lld pages written, %lld pages read\n",
+          write_cnt, read_cnt);
+  printf ("Swap: %lld clustered writes, %lld pages read ahead, "
+          "%lld swap cache hits\n",
+          cluster_cnt, readahead_cnt, cache_hit_cnt);
+  if (zswap_pages > 0)
+    {
+      size_t used = bitmap_count (zswap_blocks, 0, bitmap_size (zswap_blocks), true);
+      size_t held = bitmap_count (zswap_slots, 0, bitmap_size (zswap_slots), true);
+      long long ratio = (zswap_store_bytes > 0
+                         ? zswap_store_cnt * PGSIZE * 100 / zswap_store_bytes : 0);
+      printf ("Zswap: %zu pages held in %zu of %zu kB, "
+              "%lld pages stored, %lld read back\n",
+              held, used * ZSWAP_BLOCK_SIZE / 1024, zswap_pages * PGSIZE / 1024,
+              zswap_store_cnt, zswap_hit_cnt);
+      printf ("Zswap: compression ratio %lld.%02lld, "
+              "%lld pages spilled when full, %lld incompressible\n",
+              ratio / 100, ratio % 100, zswap_full_cnt, zswap_poor_cnt);
+    }
 }
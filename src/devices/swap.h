@@ -3,9 +3,17 @@
 
 #include <stddef.h>
 
-void swap_init (void);
+/* Most pages written or read in one multi-page swap transfer */
+#define SWAP_CLUSTER_PAGES 8
+
+void swap_init (size_t zswap_pool_pages);
 size_t swap_out (const void *vaddr);
+void swap_out_cluster (void *const pages[], size_t slots[], size_t cnt);
 void swap_in (void *vaddr, size_t slot);
+void swap_read (void *vaddr, size_t slot);
+void swap_read_cluster (void *vaddr, size_t slot, size_t cnt);
+void swap_dup (size_t slot);
 void swap_drop (size_t slot);
+void swap_print_stats (void);
 
 #endif /* devices/swap.h */
@@ -20,42 +20,99 @@
 /* Number of timer ticks since OS booted. */
 static int64_t ticks;
 
-/* struct for storing a thread's semaphore with the tick it should wake.
-   for use in sleeping_threads list */
-struct sleeping_thread_list_elem {
-  struct list_elem elem;
-  int64_t time;
-  struct semaphore sema;
-};
-
-/* list of all sleeping threads each with the tick they should wait
-   sorted in ascending order of ticks the thread should wake */
-static struct list sleeping_threads;
+/* If true, stop the periodic tick while idle.
+   Controlled by kernel command-line option "-tickless". */
+bool timer_tickless;
+
+/* PIT cycles per timer tick. */
+#define CYCLES_PER_TICK ((PIT_HZ + TIMER_FREQ / 2) / TIMER_FREQ)
+
+/* Most ticks one PIT count can cover.  The counter is only 16
+   bits wide, so at 100 Hz this is 5. */
+#define MAX_IDLE_TICKS (UINT16_MAX / CYCLES_PER_TICK)
+
+/* Tickless idle.  While the idle thread runs with nothing due in
+   the next few ticks, the PIT is switched to one-shot mode to
+   interrupt only once ONESHOT_TICKS ticks have passed.  The
+   first of those ticks ends ONESHOT_FIRST cycles into the
+   ONESHOT_COUNT-cycle count, each other one CYCLES_PER_TICK
+   cycles later.  The ticks skipped are accounted for at the next
+   interrupt, from whatever device.  Accessed only with interrupts
+   off. */
+static bool oneshot_armed;
+static int oneshot_ticks;
+static unsigned oneshot_first;
+static unsigned oneshot_count;
+
+/* Pending timeouts, in a hierarchical timing wheel.
+
+   A timeout due within WHEEL0_SLOTS ticks sits in the level 0
+   slot for its deadline, and fires when the tick count reaches
+   that slot.  Later timeouts sit in a coarser level 1 or level 2
+   slot covering WHEEL0_SLOTS or WHEEL0_SLOTS * WHEEL1_SLOTS
+   ticks, or in the overflow list if they are further away still.
+   When the tick count crosses into the range covered by a coarse
+   slot, that slot is emptied and its timeouts are re-added,
+   moving them down a level.  Adding and cancelling a timeout is
+   O(1), and every timeout is moved at most a few times before it
+   fires.  Accessed only with interrupts off. */
+#define WHEEL0_BITS 8
+#define WHEEL1_BITS 6
+#define WHEEL2_BITS 6
+#define WHEEL0_SLOTS (1 << WHEEL0_BITS)
+#define WHEEL1_SLOTS (1 << WHEEL1_BITS)
+#define WHEEL2_SLOTS (1 << WHEEL2_BITS)
+#define WHEEL1_SHIFT WHEEL0_BITS
+#define WHEEL2_SHIFT (WHEEL0_BITS + WHEEL1_BITS)
+#define OVERFLOW_SHIFT (WHEEL0_BITS + WHEEL1_BITS + WHEEL2_BITS)
+
+static struct list wheel0[WHEEL0_SLOTS];
+static struct list wheel1[WHEEL1_SLOTS];
+static struct list wheel2[WHEEL2_SLOTS];
+static struct list wheel_overflow;
+
+/* A thread sleeping in timer_sleep(). */
+struct sleeper
+  {
+    struct timer_timeout timeout;       /* Wakes the thread. */
+    struct semaphore sema;              /* Upped by the timeout. */
+  };
 
 /* Number of loops per timer tick.
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
-static list_less_func thread_list_less;
-
 static intr_handler_func timer_interrupt;
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
 static void real_time_sleep (int64_t num, int32_t denom);
 static void real_time_delay (int64_t num, int32_t denom);
 
-/*wake all threads which need to wake this tick*/
-static void check_wake_threads(struct list *threads);
+static void wheel_insert (struct timer_timeout *);
+static void wheel_cascade (struct list *);
+static void check_wake_threads (void);
+static void tick (void);
+static int idle_ticks_available (void);
+static void start_oneshot (int tick_cnt, unsigned first);
+static timer_timeout_func wake_sleeper;
 
 /* Sets up the timer to interrupt TIMER_FREQ times per second,
    and registers the corresponding interrupt. */
 void
 timer_init (void) 
 {
+  size_t i;
+
   pit_configure_channel (0, 2, TIMER_FREQ);
   intr_register_ext (0x20, timer_interrupt, "8254 Timer");
 
-  list_init(&sleeping_threads);
+  for (i = 0; i < WHEEL0_SLOTS; i++)
+    list_init (&wheel0[i]);
+  for (i = 0; i < WHEEL1_SLOTS; i++)
+    list_init (&wheel1[i]);
+  for (i = 0; i < WHEEL2_SLOTS; i++)
+    list_init (&wheel2[i]);
+  list_init (&wheel_overflow);
 }
 
 /* Calibrates loops_per_tick, used to implement brief delays. */
@@ -105,31 +162,85 @@ timer_elapsed (int64_t then)
 
 /* Sleeps for approximately TICKS timer ticks.  Interrupts must
    be turned on. */
-
-static bool thread_list_less(const struct list_elem *a, const struct list_elem *b, void * aux UNUSED) {
-  return list_entry(a, struct sleeping_thread_list_elem, elem)->time < 
-         list_entry(b, struct sleeping_thread_list_elem, elem)->time;
-}
-
 void
 timer_sleep (int64_t ticks) 
 {
   int64_t start = timer_ticks ();
+  struct sleeper sleeper;
 
   ASSERT (intr_get_level () == INTR_ON);
 
-  struct sleeping_thread_list_elem thread_elem;
-  thread_elem.time = start + ticks;
-  sema_init(&thread_elem.sema, 0);
-  /* interrupts disabled as sleeping_threads is shared between
-    interrupt handler and kernel thread */
-  enum intr_level old_level = intr_disable();
-  list_insert_ordered(&sleeping_threads, &thread_elem.elem, thread_list_less, NULL);
+  sema_init (&sleeper.sema, 0);
+  timer_timeout_init (&sleeper.timeout, wake_sleeper, &sleeper);
+  timer_timeout_add (&sleeper.timeout, start + ticks);
+  sema_down (&sleeper.sema);
+}
+
+/* Wakes up the thread sleeping in timer_sleep() on the sleeper
+   in AUX. */
+static void
+wake_sleeper (struct timer_timeout *timeout UNUSED, void *aux)
+{
+  struct sleeper *sleeper = aux;
+  sema_up (&sleeper->sema);
+}
+
+/* Initializes TIMEOUT to call FUNC, passing TIMEOUT and AUX,
+   when it fires. */
+void
+timer_timeout_init (struct timer_timeout *timeout, timer_timeout_func *func,
+                    void *aux)
+{
+  ASSERT (timeout != NULL);
+  ASSERT (func != NULL);
+
+  timeout->pending = false;
+  timeout->func = func;
+  timeout->aux = aux;
+}
+
+/* Arranges for TIMEOUT to fire at the first timer tick at which
+   timer_ticks() reaches DEADLINE, or at the next tick if that
+   is already past.  TIMEOUT must not be pending.
+
+   This function may be called from an interrupt handler,
+   including from a timeout's function. */
+void
+timer_timeout_add (struct timer_timeout *timeout, int64_t deadline)
+{
+  enum intr_level old_level;
+
+  ASSERT (timeout != NULL);
+
+  old_level = intr_disable ();
+  ASSERT (!timeout->pending);
+  timeout->deadline = deadline;
+  timeout->pending = true;
+  wheel_insert (timeout);
+  intr_set_level (old_level);
+}
 
-  /* interrupts reenabled after list access complete */
-  intr_set_level(old_level);
+/* Cancels TIMEOUT.  Returns true if it was pending, false if it
+   had already fired or was never added.
 
-  sema_down(&thread_elem.sema);  
+   This function may be called from an interrupt handler. */
+bool
+timer_timeout_cancel (struct timer_timeout *timeout)
+{
+  enum intr_level old_level;
+  bool was_pending;
+
+  ASSERT (timeout != NULL);
+
+  old_level = intr_disable ();
+  was_pending = timeout->pending;
+  if (was_pending)
+    {
+      list_remove (&timeout->elem);
+      timeout->pending = false;
+    }
+  intr_set_level (old_level);
+  return was_pending;
 }
 
 /* Sleeps for approximately MS milliseconds.  Interrupts must be
@@ -202,30 +313,213 @@ timer_print_stats (void)
   printf ("Timer: %"PRId64" ticks\n", timer_ticks ());
 }
 
-/* checks if the first element of sleeping_threads should wake on this tick.
-   if the thread should wake, it is unblocked and this repeats for the next element
-   until a thread does not need to wake */
+/* Puts pending TIMEOUT into the timer wheel slot that covers its
+   deadline, relative to the current tick.  Interrupts must be
+   off. */
+static void
+wheel_insert (struct timer_timeout *timeout)
+{
+  int64_t deadline = timeout->deadline;
+  int64_t delta = deadline - ticks;
+  struct list *slot;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (delta <= 0)
+    slot = &wheel0[(ticks + 1) & (WHEEL0_SLOTS - 1)];
+  else if (delta < WHEEL0_SLOTS)
+    slot = &wheel0[deadline & (WHEEL0_SLOTS - 1)];
+  else if (delta < (1 << WHEEL2_SHIFT))
+    slot = &wheel1[(deadline >> WHEEL1_SHIFT) & (WHEEL1_SLOTS - 1)];
+  else if (delta < (1 << OVERFLOW_SHIFT))
+    slot = &wheel2[(deadline >> WHEEL2_SHIFT) & (WHEEL2_SLOTS - 1)];
+  else
+    slot = &wheel_overflow;
+  list_push_back (slot, &timeout->elem);
+}
 
-static void check_wake_threads(struct list *threads) {
-  struct sleeping_thread_list_elem *elem;
-  while (!list_empty(threads)) {
-    elem = list_entry(list_front(threads), struct sleeping_thread_list_elem, elem);
-    if (elem->time > ticks) {
-      break;
+/* Re-inserts every timeout in SLOT, moving it to a finer level of
+   the timer wheel now that its deadline is nearer.  A timeout due
+   at the current tick goes into the current level 0 slot, which
+   check_wake_threads() fires after cascading. */
+static void
+wheel_cascade (struct list *slot)
+{
+  struct list timeouts;
+
+  /* Take over the whole slot first: re-inserting may put a
+     timeout back into the same list. */
+  list_init (&timeouts);
+  while (!list_empty (slot))
+    list_push_back (&timeouts, list_pop_front (slot));
+  while (!list_empty (&timeouts))
+    {
+      struct timer_timeout *timeout
+        = list_entry (list_pop_front (&timeouts), struct timer_timeout, elem);
+      if (timeout->deadline <= ticks)
+        list_push_back (&wheel0[ticks & (WHEEL0_SLOTS - 1)], &timeout->elem);
+      else
+        wheel_insert (timeout);
     }
-    list_remove(&elem->elem);
-    sema_up(&elem->sema);
-  }
 }
 
-/* Timer interrupt handler. */
+/* Fires every timeout whose deadline is the current tick, first
+   moving timeouts from coarser levels of the timer wheel whose
+   range starts at this tick.  The coarsest levels go first, so
+   that a timeout can move down more than one level at once. */
+static void
+check_wake_threads (void)
+{
+  struct list *slot;
+
+  if ((ticks & ((1 << OVERFLOW_SHIFT) - 1)) == 0)
+    wheel_cascade (&wheel_overflow);
+  if ((ticks & ((1 << WHEEL2_SHIFT) - 1)) == 0)
+    wheel_cascade (&wheel2[(ticks >> WHEEL2_SHIFT) & (WHEEL2_SLOTS - 1)]);
+  if ((ticks & ((1 << WHEEL1_SHIFT) - 1)) == 0)
+    wheel_cascade (&wheel1[(ticks >> WHEEL1_SHIFT) & (WHEEL1_SLOTS - 1)]);
+
+  slot = &wheel0[ticks & (WHEEL0_SLOTS - 1)];
+  while (!list_empty (slot))
+    {
+      struct timer_timeout *timeout
+        = list_entry (list_pop_front (slot), struct timer_timeout, elem);
+      timeout->pending = false;
+      timeout->func (timeout, timeout->aux);
+    }
+}
+
+/* Called by the idle thread, with interrupts off, just before it
+   waits for an interrupt.  In tickless mode, switches the timer
+   to a single interrupt at the next tick at which something may
+   need to happen, if that is at least two ticks away. */
+void
+timer_idle_enter (void)
+{
+  unsigned first;
+  int skip;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (!timer_tickless || oneshot_armed)
+    return;
+  skip = idle_ticks_available ();
+  if (skip < 2)
+    return;
+
+  /* Keep the tick phase: the first tick is due when the current
+     period would have ended. */
+  first = pit_read_count (0);
+  if (first == 0 || first > CYCLES_PER_TICK)
+    first = CYCLES_PER_TICK;
+  start_oneshot (skip, first);
+}
+
+/* Called at the start of every external interrupt.  If the timer
+   was switched to one-shot mode by timer_idle_enter(), runs the
+   tick processing for each tick that passed since, so that
+   timer_ticks(), sleeping threads and MLFQS statistics catch up
+   before the interrupt is handled. */
+void
+timer_idle_exit (void)
+{
+  unsigned count, elapsed;
+  int passed, i;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (!oneshot_armed)
+    return;
+
+  /* Read the count first and only then check whether it had
+     expired.  Once the count expires, the output goes high and
+     stays high while the counter wraps around, so a count read
+     before a low output is a valid count. */
+  count = pit_read_count (0);
+  if (pit_output_high (0))
+    {
+      /* The count expired and its timer interrupt is now being
+         handled or pending.  That interrupt accounts for the
+         last tick. */
+      oneshot_armed = false;
+      pit_configure_channel (0, 2, TIMER_FREQ);
+      for (i = 0; i < oneshot_ticks - 1; i++)
+        tick ();
+      return;
+    }
+
+  /* Woken early by another device.  Account for the ticks that
+     passed, then count only to the next tick boundary, whose
+     interrupt switches back to periodic mode. */
+  if (count > oneshot_count)
+    count = oneshot_count;
+  elapsed = oneshot_count - count;
+  passed = elapsed < oneshot_first
+           ? 0 : 1 + (elapsed - oneshot_first) / CYCLES_PER_TICK;
+  if (passed >= oneshot_ticks)
+    passed = oneshot_ticks - 1;
+  for (i = 0; i < passed; i++)
+    tick ();
+  start_oneshot (1, oneshot_first + passed * CYCLES_PER_TICK - elapsed);
+}
+
+/* Timer interrupt handler.  timer_idle_exit() has already run,
+   so if a one-shot count is still armed, this interrupt was
+   raised by an earlier count that expired just as
+   timer_idle_exit() replaced it.  The tick it stands for is
+   accounted for when the replacement count expires. */
 static void
 timer_interrupt (struct intr_frame *args UNUSED)
+{
+  if (!oneshot_armed)
+    tick ();
+}
+
+/* Advances the tick count by one and does the work due at that
+   tick. */
+static void
+tick (void)
 {
   ticks++;
   thread_tick ();
 
-  check_wake_threads(&sleeping_threads);
+  check_wake_threads ();
+}
+
+/* Returns the number of ticks, up to MAX_IDLE_TICKS, until the
+   first tick at which a timeout may fire: either one whose
+   level 0 slot is nonempty, or one at which coarser levels of
+   the timer wheel are cascaded. */
+static int
+idle_ticks_available (void)
+{
+  int skip;
+
+  for (skip = 1; skip < MAX_IDLE_TICKS; skip++)
+    {
+      int64_t t = ticks + skip;
+      if ((t & (WHEEL0_SLOTS - 1)) == 0
+          || !list_empty (&wheel0[t & (WHEEL0_SLOTS - 1)]))
+        break;
+    }
+  return skip;
+}
+
+/* Programs the PIT to interrupt once, after TICK_CNT ticks, the
+   first of which ends FIRST cycles from now. */
+static void
+start_oneshot (int tick_cnt, unsigned first)
+{
+  ASSERT (tick_cnt >= 1 && tick_cnt <= MAX_IDLE_TICKS);
+  ASSERT (first <= CYCLES_PER_TICK);
+
+  if (first == 0)
+    first = 1;
+  oneshot_armed = true;
+  oneshot_ticks = tick_cnt;
+  oneshot_first = first;
+  oneshot_count = first + (tick_cnt - 1) * CYCLES_PER_TICK;
+  pit_start_oneshot (0, oneshot_count);
 }
 
 /* Returns true if LOOPS iterations waits for more than one timer
@@ -1,14 +1,22 @@
 #ifndef DEVICES_TIMER_H
 #define DEVICES_TIMER_H
 
+#include <list.h>
 #include <round.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 /* Number of timer interrupts per second. */
 #define TIMER_FREQ 100
 
+/* If true, stop the periodic tick while idle.
+   Controlled by kernel command-line option "-tickless". */
+extern bool timer_tickless;
+
 void timer_init (void);
 void timer_calibrate (void);
+void timer_idle_enter (void);
+void timer_idle_exit (void);
 
 int64_t timer_ticks (void);
 int64_t timer_elapsed (int64_t);
@@ -19,6 +27,26 @@ void timer_msleep (int64_t milliseconds);
 void timer_usleep (int64_t microseconds);
 void timer_nsleep (int64_t nanoseconds);
 
+/* Timeouts.  A timeout calls its function, in the timer
+   interrupt handler, once the tick count reaches its deadline,
+   unless it is cancelled first. */
+struct timer_timeout;
+typedef void timer_timeout_func (struct timer_timeout *, void *aux);
+
+struct timer_timeout
+  {
+    struct list_elem elem;      /* Element in a timer wheel slot. */
+    int64_t deadline;           /* Tick at which to call FUNC. */
+    bool pending;               /* Added but not yet fired or cancelled? */
+    timer_timeout_func *func;   /* Function to call. */
+    void *aux;                  /* Auxiliary data for FUNC. */
+  };
+
+void timer_timeout_init (struct timer_timeout *, timer_timeout_func *,
+                         void *aux);
+void timer_timeout_add (struct timer_timeout *, int64_t deadline);
+bool timer_timeout_cancel (struct timer_timeout *);
+
 /* Busy waits. */
 void timer_mdelay (int64_t milliseconds);
 void timer_udelay (int64_t microseconds);
@@ -0,0 +1,563 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <hash.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Write-back buffer cache for the file system device.
+
+   Every sector of fs_device that the file system touches goes
+   through this cache, so that repeated accesses to the same
+   inode, directory or data sectors are served from memory.
+   Writes only dirty the cached copy.  A flusher thread writes
+   dirty sectors back every FLUSH_INTERVAL_MS milliseconds,
+   grouping sectors that are adjacent on disk into a single
+   multi-sector transfer, so that writers rarely wait for the
+   disk themselves.  Eviction still writes back a victim that is
+   dirty.  Victims are chosen with the clock algorithm.
+
+   Sectors can also be requested ahead of time with
+   cache_prefetch(), which hands them to a dedicated read-ahead
+   thread so that the caller doesn't wait for the disk. */
+
+/* A cached sector. */
+struct cache_entry
+  {
+    struct hash_elem hash_elem;         /* Element in cache_map. */
+    block_sector_t sector;              /* Sector held, if in_use. */
+    bool in_use;                        /* In cache_map? */
+    bool valid;                         /* DATA holds the sector's contents? */
+    bool dirty;                         /* DATA newer than disk? */
+    bool accessed;                      /* Used since last clock sweep? */
+    bool prefetched;                    /* Read ahead and not used since? */
+    int pin_cnt;                        /* Threads using this entry. */
+    struct lock lock;                   /* Serializes access to DATA. */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Sector contents. */
+  };
+
+static struct cache_entry *entries;     /* Array of ENTRY_CNT entries. */
+static size_t entry_cnt;                /* Number of entries. */
+static size_t clock_hand;               /* Next eviction candidate. */
+
+/* Maps sector numbers to entries that are in use. */
+static struct hash cache_map;
+
+/* Protects cache_map, clock_hand, and every entry's SECTOR,
+   IN_USE, ACCESSED and PIN_CNT members. */
+static struct lock cache_lock;
+
+/* Signaled when an entry's pin count drops to zero. */
+static struct condition entry_unpinned;
+
+/* Statistics. */
+static long long hit_cnt;               /* Lookups found in cache. */
+static long long miss_cnt;              /* Lookups read from disk. */
+static long long evict_cnt;             /* Entries reused for new sectors. */
+static long long writeback_cnt;         /* Dirty sectors written to disk. */
+static long long prefetch_cnt;          /* Sectors read by read-ahead. */
+static long long prefetch_hit_cnt;      /* Read-ahead sectors later used. */
+
+/* Read-ahead requests, as a circular queue of sector numbers.
+   Requests that arrive while the queue is full are dropped:
+   read-ahead is only a hint. */
+#define PREFETCH_QUEUE_SIZE 64
+static block_sector_t prefetch_queue[PREFETCH_QUEUE_SIZE];
+static size_t prefetch_head;            /* Next request to serve. */
+static size_t prefetch_cnt_queued;      /* Number of queued requests. */
+static struct lock prefetch_lock;       /* Protects the queue. */
+static struct condition prefetch_ready; /* Signaled when queue nonempty. */
+
+/* Milliseconds between write-behind passes of the flusher. */
+#define FLUSH_INTERVAL_MS 1000
+
+/* Most sectors written back with a single block device request.
+   A run is gathered into a one-page bounce buffer. */
+#define FLUSH_RUN_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* State used by cache_flush(), protected by flush_lock. */
+static struct lock flush_lock;
+static struct cache_entry **flush_list; /* ENTRY_CNT entries to write. */
+static uint8_t *flush_buffer;           /* Bounce buffer for one run. */
+
+static hash_hash_func cache_hash;
+static hash_less_func cache_less;
+static struct cache_entry *cache_get (block_sector_t, bool read_data,
+                                      bool prefetch);
+static void cache_put (struct cache_entry *);
+static void cache_unpin (struct cache_entry *);
+static struct cache_entry *cache_lookup (block_sector_t);
+static struct cache_entry *cache_evict (void);
+static thread_func readahead_thread NO_RETURN;
+static thread_func flusher_thread NO_RETURN;
+static void flush_run (struct cache_entry **, size_t cnt);
+static int compare_sectors (const void *, const void *, void *aux);
+
+/* Initializes the buffer cache to hold SECTOR_CNT sectors and
+   starts the read-ahead and flusher threads. */
+void
+cache_init (size_t sector_cnt)
+{
+  size_t i;
+
+  if (sector_cnt == 0)
+    PANIC ("buffer cache must hold at least one sector");
+
+  entries = malloc (sector_cnt * sizeof *entries);
+  if (entries == NULL)
+    PANIC ("couldn't allocate %zu-sector buffer cache", sector_cnt);
+  entry_cnt = sector_cnt;
+  clock_hand = 0;
+
+  for (i = 0; i < entry_cnt; i++)
+    {
+      struct cache_entry *e = &entries[i];
+      e->in_use = false;
+      e->valid = false;
+      e->dirty = false;
+      e->accessed = false;
+      e->prefetched = false;
+      e->pin_cnt = 0;
+      lock_init (&e->lock);
+    }
+
+  hash_init (&cache_map, cache_hash, cache_less, NULL);
+  lock_init (&cache_lock);
+  cond_init (&entry_unpinned);
+
+  lock_init (&flush_lock);
+  flush_list = malloc (sector_cnt * sizeof *flush_list);
+  flush_buffer = palloc_get_page (0);
+  if (flush_list == NULL || flush_buffer == NULL)
+    PANIC ("couldn't allocate buffer cache flush state");
+
+  lock_init (&prefetch_lock);
+  cond_init (&prefetch_ready);
+  if (thread_create ("readahead", PRI_DEFAULT, readahead_thread, NULL)
+      == TID_ERROR)
+    PANIC ("couldn't start read-ahead thread");
+  if (thread_create ("flusher", PRI_DEFAULT, flusher_thread, NULL)
+      == TID_ERROR)
+    PANIC ("couldn't start flusher thread");
+}
+
+/* Reads sector SECTOR into BUFFER, which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+void
+cache_read (block_sector_t sector, void *buffer)
+{
+  cache_read_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads SIZE bytes starting at byte offset OFS within sector
+   SECTOR into BUFFER.  Returns true if the sector was brought in
+   by read-ahead and this is the first time it has been used. */
+bool
+cache_read_at (block_sector_t sector, void *buffer, int ofs, int size)
+{
+  struct cache_entry *e;
+  bool prefetched;
+
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, true, false);
+  memcpy (buffer, e->data + ofs, size);
+  prefetched = e->prefetched;
+  e->prefetched = false;
+  cache_put (e);
+
+  if (prefetched)
+    prefetch_hit_cnt++;
+  return prefetched;
+}
+
+/* Asks the read-ahead thread to bring SECTOR into the cache.
+   Returns without waiting for the disk. */
+void
+cache_prefetch (block_sector_t sector)
+{
+  lock_acquire (&prefetch_lock);
+  if (prefetch_cnt_queued < PREFETCH_QUEUE_SIZE)
+    {
+      size_t tail = (prefetch_head + prefetch_cnt_queued) % PREFETCH_QUEUE_SIZE;
+      prefetch_queue[tail] = sector;
+      prefetch_cnt_queued++;
+      cond_signal (&prefetch_ready, &prefetch_lock);
+    }
+  lock_release (&prefetch_lock);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes from BUFFER into sector
+   SECTOR.  The data reaches the disk when the sector is evicted
+   or the cache is next flushed. */
+void
+cache_write (block_sector_t sector, const void *buffer)
+{
+  cache_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SIZE bytes from BUFFER into sector SECTOR, starting at
+   byte offset OFS within the sector. */
+void
+cache_write_at (block_sector_t sector, const void *buffer, int ofs, int size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  /* A write that covers the whole sector doesn't need the old
+     contents. */
+  e = cache_get (sector, size < BLOCK_SECTOR_SIZE, false);
+  memcpy (e->data + ofs, buffer, size);
+  e->valid = true;
+  e->dirty = true;
+  e->prefetched = false;
+  cache_put (e);
+}
+
+/* Writes every dirty sector in the cache back to disk, in order
+   of sector number, combining runs of adjacent sectors into
+   single transfers. */
+void
+cache_flush (void)
+{
+  size_t flush_cnt = 0;
+  size_t run_start, i;
+
+  lock_acquire (&flush_lock);
+
+  /* Pin every dirty entry so that it can't be evicted, and so
+     reassigned to another sector, while we write it.  DIRTY is
+     read without the entry's lock, so a sector dirtied
+     concurrently may be missed; it will be written by the next
+     flush. */
+  lock_acquire (&cache_lock);
+  for (i = 0; i < entry_cnt; i++)
+    {
+      struct cache_entry *e = &entries[i];
+      if (e->in_use && e->dirty)
+        {
+          e->pin_cnt++;
+          flush_list[flush_cnt++] = e;
+        }
+    }
+  lock_release (&cache_lock);
+
+  sort (flush_list, flush_cnt, sizeof *flush_list, compare_sectors, NULL);
+
+  /* Write runs of consecutive sectors. */
+  run_start = 0;
+  for (i = 1; i <= flush_cnt; i++)
+    if (i == flush_cnt
+        || i - run_start == FLUSH_RUN_SECTORS
+        || flush_list[i]->sector != flush_list[i - 1]->sector + 1)
+      {
+        flush_run (flush_list + run_start, i - run_start);
+        run_start = i;
+      }
+
+  lock_release (&flush_lock);
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
+{
+  printf ("Cache: %lld hits, %lld misses, %lld evictions, "
+          "%lld write-backs\n",
+          hit_cnt, miss_cnt, evict_cnt, writeback_cnt);
+  printf ("Cache: %lld sectors read ahead, %lld used\n",
+          prefetch_cnt, prefetch_hit_cnt);
+}
+
+/* Read-ahead thread.  Serves cache_prefetch() requests by
+   reading each requested sector into the cache, unless it is
+   there already.  Any thread waiting for the disk on behalf of
+   read-ahead is this one, not the reader that asked for it. */
+static void
+readahead_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      block_sector_t sector;
+
+      lock_acquire (&prefetch_lock);
+      while (prefetch_cnt_queued == 0)
+        cond_wait (&prefetch_ready, &prefetch_lock);
+      sector = prefetch_queue[prefetch_head];
+      prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE_SIZE;
+      prefetch_cnt_queued--;
+      lock_release (&prefetch_lock);
+
+      cache_put (cache_get (sector, true, true));
+    }
+}
+
+/* Flusher thread.  Writes dirty sectors, including pending free
+   map changes, back to disk every FLUSH_INTERVAL_MS
+   milliseconds, so that eviction seldom has to and so that a
+   crash loses little data. */
+static void
+flusher_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      timer_msleep (FLUSH_INTERVAL_MS);
+      free_map_flush ();
+      cache_flush ();
+    }
+}
+
+/* Writes the CNT pinned entries in RUN, which hold consecutive
+   sectors in ascending order, to disk with one request and then
+   unpins them.  Each entry's data is copied into flush_buffer
+   under its lock, so writers only wait for the copy, not for the
+   disk.  An entry that was cleaned in the meantime, for example
+   by eviction, is skipped, splitting the run.
+   flush_lock must be held. */
+static void
+flush_run (struct cache_entry **run, size_t cnt)
+{
+  size_t copied = 0;
+  block_sector_t start = 0;
+  size_t i;
+
+  ASSERT (cnt <= FLUSH_RUN_SECTORS);
+
+  for (i = 0; i < cnt; i++)
+    {
+      struct cache_entry *e = run[i];
+
+      lock_acquire (&e->lock);
+      if (e->valid && e->dirty)
+        {
+          if (copied == 0)
+            start = e->sector;
+          memcpy (flush_buffer + copied * BLOCK_SECTOR_SIZE, e->data,
+                  BLOCK_SECTOR_SIZE);
+          e->dirty = false;
+          copied++;
+        }
+      else if (copied > 0)
+        {
+          block_write_multiple (fs_device, start, copied, flush_buffer);
+          writeback_cnt += copied;
+          copied = 0;
+        }
+      lock_release (&e->lock);
+    }
+  if (copied > 0)
+    {
+      block_write_multiple (fs_device, start, copied, flush_buffer);
+      writeback_cnt += copied;
+    }
+
+  /* Only unpin after the data is on disk, so that a reader
+     can't evict and re-read one of these sectors before it has
+     been written. */
+  for (i = 0; i < cnt; i++)
+    cache_unpin (run[i]);
+}
+
+/* Returns the entry holding SECTOR, pinned and with its lock
+   held, bringing it into the cache if necessary.  If READ_DATA
+   is true, the entry's data is valid on return; otherwise the
+   caller is about to overwrite the whole sector.  PREFETCH is
+   true for read-ahead, which doesn't count as a use of the
+   sector. */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool read_data, bool prefetch)
+{
+  struct cache_entry *e;
+
+  lock_acquire (&cache_lock);
+  for (;;)
+    {
+      e = cache_lookup (sector);
+      if (e != NULL)
+        {
+          if (!prefetch)
+            {
+              hit_cnt++;
+              e->accessed = true;
+            }
+          e->pin_cnt++;
+          lock_release (&cache_lock);
+          lock_acquire (&e->lock);
+          break;
+        }
+
+      /* Eviction may drop cache_lock to write back a dirty
+         victim, and another thread may bring SECTOR in
+         meanwhile.  The freed entry is then left for the next
+         miss. */
+      e = cache_evict ();
+      if (e != NULL && cache_lookup (sector) != NULL)
+        continue;
+      if (e != NULL)
+        {
+          if (prefetch)
+            prefetch_cnt++;
+          else
+            miss_cnt++;
+          e->sector = sector;
+          e->in_use = true;
+          e->valid = false;
+          e->dirty = false;
+          e->accessed = true;
+          e->prefetched = prefetch;
+          e->pin_cnt = 1;
+          hash_insert (&cache_map, &e->hash_elem);
+
+          /* Nobody else can hold the lock of an unpinned entry,
+             so this doesn't block, and holding it before
+             dropping cache_lock keeps other threads from seeing
+             the entry before its data is valid. */
+          lock_acquire (&e->lock);
+          lock_release (&cache_lock);
+          break;
+        }
+
+      /* Every entry is pinned.  Another thread may bring SECTOR
+         in while we wait, so look it up again afterward. */
+      cond_wait (&entry_unpinned, &cache_lock);
+    }
+
+  if (read_data && !e->valid)
+    {
+      block_read (fs_device, sector, e->data);
+      e->valid = true;
+    }
+  return e;
+}
+
+/* Releases entry E obtained from cache_get(). */
+static void
+cache_put (struct cache_entry *e)
+{
+  lock_release (&e->lock);
+  cache_unpin (e);
+}
+
+/* Drops one pin on entry E. */
+static void
+cache_unpin (struct cache_entry *e)
+{
+  lock_acquire (&cache_lock);
+  ASSERT (e->pin_cnt > 0);
+  if (--e->pin_cnt == 0)
+    cond_signal (&entry_unpinned, &cache_lock);
+  lock_release (&cache_lock);
+}
+
+/* Returns the in-use entry holding SECTOR, or a null pointer if
+   SECTOR is not cached.  cache_lock must be held. */
+static struct cache_entry *
+cache_lookup (block_sector_t sector)
+{
+  struct cache_entry key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&cache_map, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct cache_entry, hash_elem) : NULL;
+}
+
+/* Chooses an unpinned entry with the clock algorithm, writes it
+   back if it is dirty, and removes it from cache_map.  Returns a
+   null pointer if every entry is pinned.
+   cache_lock must be held.  It is released while a dirty victim
+   is written back, so that hits on other sectors don't wait for
+   the disk. */
+static struct cache_entry *
+cache_evict (void)
+{
+  size_t left;
+
+  /* Two sweeps are enough to find any unpinned entry: the first
+     clears accessed bits, the second finds them clear. */
+  for (left = 2 * entry_cnt; left > 0; left--)
+    {
+      struct cache_entry *e = &entries[clock_hand];
+      clock_hand = (clock_hand + 1) % entry_cnt;
+
+      if (!e->in_use)
+        return e;
+      if (e->pin_cnt > 0)
+        continue;
+      if (e->accessed)
+        {
+          e->accessed = false;
+          continue;
+        }
+
+      if (e->dirty)
+        {
+          /* Pin the victim so that it can't be chosen again or
+             reassigned while we write it. */
+          e->pin_cnt++;
+          lock_release (&cache_lock);
+          lock_acquire (&e->lock);
+          if (e->dirty)
+            {
+              block_write (fs_device, e->sector, e->data);
+              e->dirty = false;
+              writeback_cnt++;
+            }
+          lock_release (&e->lock);
+          lock_acquire (&cache_lock);
+
+          /* Reuse it only if nobody used it in the meantime.
+             Otherwise start over, since other entries may have
+             been unpinned while cache_lock was released. */
+          if (--e->pin_cnt > 0 || e->dirty || e->accessed)
+            {
+              if (e->pin_cnt == 0)
+                cond_signal (&entry_unpinned, &cache_lock);
+              left = 2 * entry_cnt + 1;
+              continue;
+            }
+        }
+      hash_delete (&cache_map, &e->hash_elem);
+      e->in_use = false;
+      evict_cnt++;
+      return e;
+    }
+  return NULL;
+}
+
+/* Returns a hash value for the cache entry in E. */
+static unsigned
+cache_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_entry *ce = hash_entry (e, struct cache_entry, hash_elem);
+  return hash_int (ce->sector);
+}
+
+/* Compares the sectors of the cache entries pointed to by A and
+   B, for sorting an array of entry pointers. */
+static int
+compare_sectors (const void *a_, const void *b_, void *aux UNUSED)
+{
+  const struct cache_entry *a = *(struct cache_entry *const *) a_;
+  const struct cache_entry *b = *(struct cache_entry *const *) b_;
+
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Returns true if cache entry A's sector precedes B's. */
+static bool
+cache_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct cache_entry, hash_elem)->sector
+          < hash_entry (b, struct cache_entry, hash_elem)->sector);
+}
@@ -0,0 +1,21 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+/* Number of sectors held by the buffer cache unless overridden
+   with the -cache kernel command-line option. */
+#define CACHE_DEFAULT_SECTORS 64
+
+void cache_init (size_t sector_cnt);
+void cache_read (block_sector_t, void *);
+bool cache_read_at (block_sector_t, void *, int ofs, int size);
+void cache_write (block_sector_t, const void *);
+void cache_write_at (block_sector_t, const void *, int ofs, int size);
+void cache_prefetch (block_sector_t);
+void cache_flush (void);
+void cache_print_stats (void);
+
+#endif /* filesys/cache.h */
@@ -5,6 +5,7 @@
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* A directory. */
 struct dir 
@@ -87,7 +88,8 @@ dir_get_inode (struct dir *dir)
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
    directory entry if OFSP is non-null.
-   otherwise, returns false and ignores EP and OFSP. */
+   otherwise, returns false and ignores EP and OFSP.
+   The directory's lock must be held. */
 static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
@@ -124,10 +126,12 @@ dir_lookup (const struct dir *dir, const char *name,
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  rwlock_acquire_shared (inode_dir_lock (dir->inode));
   if (lookup (dir, name, &e, NULL))
     *inode = inode_open (e.inode_sector);
   else
     *inode = NULL;
+  rwlock_release (inode_dir_lock (dir->inode));
 
   return *inode != NULL;
 }
@@ -152,7 +156,10 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
-  /* Check that NAME is not in use. */
+  /* Check that NAME is not in use.  Hold the directory's lock
+     exclusive until the new entry is written, so that no one
+     else takes NAME or the free slot in between. */
+  rwlock_acquire_exclusive (inode_dir_lock (dir->inode));
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
@@ -175,6 +182,7 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
  done:
+  rwlock_release (inode_dir_lock (dir->inode));
   return success;
 }
 
@@ -193,6 +201,7 @@ dir_remove (struct dir *dir, const char *name)
   ASSERT (name != NULL);
 
   /* Find directory entry. */
+  rwlock_acquire_exclusive (inode_dir_lock (dir->inode));
   if (!lookup (dir, name, &e, &ofs))
     goto done;
 
@@ -211,6 +220,7 @@ dir_remove (struct dir *dir, const char *name)
   success = true;
 
  done:
+  rwlock_release (inode_dir_lock (dir->inode));
   inode_close (inode);
   return success;
 }
@@ -222,15 +232,19 @@ bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
   struct dir_entry e;
+  bool found = false;
 
+  rwlock_acquire_shared (inode_dir_lock (dir->inode));
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
     {
       dir->pos += sizeof e;
       if (e.in_use)
         {
           strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
+          found = true;
+          break;
         } 
     }
-  return false;
+  rwlock_release (inode_dir_lock (dir->inode));
+  return found;
 }
@@ -1,13 +1,38 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
 
+/* Changes to the free map are written back lazily, by
+   free_map_flush().  Each bit of dirty_sectors covers one
+   BLOCK_SECTOR_SIZE piece of the free map file, so that a flush
+   only rewrites the pieces that changed. */
+static struct bitmap *dirty_sectors;
+
+/* Sector at which free_map_allocate() starts searching: just
+   past its previous allocation. */
+static block_sector_t search_hint;
+
+/* Protects free_map, free_map_file, dirty_sectors and
+   search_hint. */
+static struct lock free_map_lock;
+
+/* Set by free_map_init() once free_map_lock is initialized.  The
+   cache's flusher thread, which calls free_map_flush(), starts
+   before the free map is initialized. */
+static bool free_map_initialized;
+
+static bool allocate (block_sector_t start, size_t cnt, block_sector_t *);
+static void mark_dirty (block_sector_t sector, size_t cnt);
+static void flush (void);
+
 /* Initializes the free map. */
 void
 free_map_init (void) 
@@ -15,56 +40,105 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  dirty_sectors = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                               BLOCK_SECTOR_SIZE));
+  if (dirty_sectors == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  search_hint = 0;
+  lock_init (&free_map_lock);
+  free_map_initialized = true;
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+   the first into *SECTORP.  The search starts just after the
+   previous allocation and wraps around, instead of rescanning
+   the allocated sectors at the start of the disk every time.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
-    {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
-    }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = allocate (search_hint, cnt, sectorp);
+  if (success)
+    search_hint = *sectorp + cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Allocates one sector from the free map, preferring the first
+   free sector at or after HINT so that blocks allocated one at a
+   time for a growing file stay in sequence on disk, and stores
+   it into *SECTORP.
+   Returns true if successful, false if the disk is full. */
+bool
+free_map_allocate_near (block_sector_t hint, block_sector_t *sectorp)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = allocate (hint, 1, sectorp);
+  lock_release (&free_map_lock);
+  return success;
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  mark_dirty (sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Writes the parts of the free map that changed since the last
+   flush to the free map file.  They reach the disk along with
+   the rest of the buffer cache.  Does nothing if the free map
+   isn't initialized yet or its file isn't open. */
+void
+free_map_flush (void)
+{
+  if (!free_map_initialized)
+    return;
+
+  lock_acquire (&free_map_lock);
+  flush ();
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
 void
 free_map_open (void) 
 {
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  struct file *file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_read (free_map, free_map_file))
+
+  lock_acquire (&free_map_lock);
+  if (!bitmap_read (free_map, file))
     PANIC ("can't read free map");
+  free_map_file = file;
+  lock_release (&free_map_lock);
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
-  file_close (free_map_file);
+  struct file *file;
+
+  lock_acquire (&free_map_lock);
+  flush ();
+  file = free_map_file;
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
+  file_close (file);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -72,14 +146,81 @@ free_map_close (void)
 void
 free_map_create (void) 
 {
+  struct file *file;
+
   /* Create inode. */
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
     PANIC ("free map creation failed");
 
   /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
+  lock_acquire (&free_map_lock);
+  if (!bitmap_write (free_map, file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty_sectors, false);
+  free_map_file = file;
+  lock_release (&free_map_lock);
+}
+
+/* Allocates CNT consecutive sectors, searching from sector START
+   to the end of the free map and then from its beginning, and
+   stores the first into *SECTORP.
+   Returns true if successful, false otherwise.
+   free_map_lock must be held. */
+static bool
+allocate (block_sector_t start, size_t cnt, block_sector_t *sectorp)
+{
+  block_sector_t sector;
+
+  if (start >= bitmap_size (free_map))
+    start = 0;
+  sector = bitmap_scan_and_flip (free_map, start, cnt, false);
+  if (sector == BITMAP_ERROR && start > 0)
+    sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
+  if (sector == BITMAP_ERROR)
+    return false;
+
+  mark_dirty (sector, cnt);
+  *sectorp = sector;
+  return true;
+}
+
+/* Writes the dirty parts of the free map to the free map file,
+   if it is open.
+   free_map_lock must be held. */
+static void
+flush (void)
+{
+  size_t idx;
+
+  if (free_map_file == NULL)
+    return;
+  for (idx = bitmap_scan (dirty_sectors, 0, 1, true);
+       idx != BITMAP_ERROR;
+       idx = bitmap_scan (dirty_sectors, idx + 1, 1, true))
+    {
+      if (!bitmap_write_partial (free_map, free_map_file,
+                                 idx * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE))
+        PANIC ("can't write free map");
+      bitmap_reset (dirty_sectors, idx);
+    }
+}
+
+/* Notes that the bits for the CNT sectors starting at SECTOR
+   changed, so the free map file sectors that hold them must be
+   written back.
+   free_map_lock must be held. */
+static void
+mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t bits_per_sector = BLOCK_SECTOR_SIZE * 8;
+  size_t first, last;
+
+  if (cnt == 0)
+    return;
+  first = sector / bits_per_sector;
+  last = (sector + cnt - 1) / bits_per_sector;
+  bitmap_set_multiple (dirty_sectors, first, last - first + 1, true);
 }
@@ -2,22 +2,43 @@
 #include <list.h>
 #include <debug.h>
 #include <round.h>
+#include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Largest read-ahead window, in sectors. */
+#define READAHEAD_MAX_SECTORS 16
+
+/* Number of data sectors that an inode points to directly,
+   through its indirect sector, and through its doubly indirect
+   sector.  Sector numbers of data and index sectors that haven't
+   been allocated are 0, which is the free map's own inode and so
+   can never be part of a file. */
+#define DIRECT_CNT 124
+#define PTRS_PER_SECTOR ((off_t) (BLOCK_SECTOR_SIZE / sizeof (block_sector_t)))
+#define INDIRECT_IDX DIRECT_CNT
+#define DBL_INDIRECT_IDX (DIRECT_CNT + 1)
+#define INODE_SECTOR_CNT (DIRECT_CNT + 2)
+
+/* Largest file, in sectors. */
+#define MAX_FILE_SECTORS (DIRECT_CNT + PTRS_PER_SECTOR \
+                          + PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
+    block_sector_t sectors[INODE_SECTOR_CNT]; /* Direct, indirect and
+                                                 doubly indirect. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -28,40 +49,225 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
-/* In-memory inode. */
+/* In-memory inode.
+
+   ELEM is protected by open_inodes_lock.  LOCK protects the rest,
+   except SECTOR, which never changes, and DIR_LOCK.  OPEN_CNT
+   only drops to 0 with open_inodes_lock held exclusive, so an
+   inode found in open_inodes stays valid while the list is held
+   shared.  LOCK is only held while looking up or allocating
+   sectors, never while data is copied to or from the caller's
+   buffer, which may be user memory that page faults in from
+   another file. */
 struct inode 
   {
     struct list_elem elem;              /* Element in inode list. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    struct lock lock;                   /* Protects data and state below. */
+    struct rwlock dir_lock;             /* Protects directory entries. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    block_sector_t last_alloc;          /* Sector most recently allocated. */
     struct inode_disk data;             /* Inode content. */
+
+    /* Read-ahead state. */
+    off_t ra_next_ofs;                  /* Where a sequential read starts. */
+    int ra_window;                      /* Sectors to read ahead. */
+    off_t ra_frontier;                  /* File sectors before this queued. */
+    unsigned ra_issued;                 /* Sectors queued for read-ahead. */
+    unsigned ra_hits;                   /* Reads served by read-ahead. */
   };
 
+/* Returns the sector stored in entry IDX of index sector INDEX,
+   or of the pointers kept in INODE's inode_disk if INDEX is 0.
+   INODE's lock must be held.
+   If the entry is 0 and ALLOCATE is true, first
+   allocates a zeroed sector for it, preferably just after the
+   last sector allocated for INODE.
+   Returns 0 if the entry is unallocated and ALLOCATE is false or
+   the disk is full. */
+static block_sector_t
+index_entry (struct inode *inode, block_sector_t index, off_t idx,
+             bool allocate)
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+  block_sector_t sector;
+
+  if (index == 0)
+    sector = inode->data.sectors[idx];
+  else
+    cache_read_at (index, &sector, idx * sizeof sector, sizeof sector);
+  if (sector != 0 || !allocate)
+    return sector;
+
+  if (!free_map_allocate_near (inode->last_alloc + 1, &sector))
+    return 0;
+  inode->last_alloc = sector;
+  cache_write (sector, zeros);
+  if (index == 0)
+    {
+      inode->data.sectors[idx] = sector;
+      cache_write (inode->sector, &inode->data);
+    }
+  else
+    cache_write_at (index, &sector, idx * sizeof sector, sizeof sector);
+  return sector;
+}
+
+/* Returns the block device sector that holds data sector
+   SECTOR_IDX of INODE, walking its direct, indirect or doubly
+   indirect pointers.  If ALLOCATE is true, allocates the data
+   sector and any missing index sectors on the way.
+   Returns 0 if the sector is not allocated and ALLOCATE is false
+   or the disk is full. */
+static block_sector_t
+get_data_sector (struct inode *inode, off_t sector_idx, bool allocate)
+{
+  off_t path[3];
+  size_t depth, i;
+  block_sector_t sector;
+
+  ASSERT (sector_idx >= 0);
+
+  if (sector_idx < DIRECT_CNT)
+    {
+      path[0] = sector_idx;
+      depth = 1;
+    }
+  else if (sector_idx < DIRECT_CNT + PTRS_PER_SECTOR)
+    {
+      path[0] = INDIRECT_IDX;
+      path[1] = sector_idx - DIRECT_CNT;
+      depth = 2;
+    }
+  else if (sector_idx < MAX_FILE_SECTORS)
+    {
+      sector_idx -= DIRECT_CNT + PTRS_PER_SECTOR;
+      path[0] = DBL_INDIRECT_IDX;
+      path[1] = sector_idx / PTRS_PER_SECTOR;
+      path[2] = sector_idx % PTRS_PER_SECTOR;
+      depth = 3;
+    }
+  else
+    return 0;
+
+  sector = 0;
+  for (i = 0; i < depth; i++)
+    {
+      sector = index_entry (inode, sector, path[i], allocate);
+      if (sector == 0)
+        break;
+    }
+  return sector;
+}
+
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
+   within INODE, whose lock must be held.
    Returns -1 if INODE does not contain data for a byte at offset
    POS. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos) 
 {
   ASSERT (inode != NULL);
   if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
+    return get_data_sector (inode, pos / BLOCK_SECTOR_SIZE, false);
   else
     return -1;
 }
 
+/* Allocates zeroed sectors for INODE, whose lock must be held,
+   so that it can grow to LENGTH bytes.  INODE's length is left
+   unchanged: see set_length().
+   Returns true if successful, false if the disk is full or
+   LENGTH exceeds the largest file size.  On failure, sectors
+   already allocated stay attached to INODE and are reused by the
+   next attempt. */
+static bool
+allocate_to (struct inode *inode, off_t length)
+{
+  off_t sector_idx;
+
+  for (sector_idx = bytes_to_sectors (inode->data.length);
+       sector_idx < (off_t) bytes_to_sectors (length); sector_idx++)
+    if (get_data_sector (inode, sector_idx, true) == 0)
+      return false;
+  return true;
+}
+
+/* Grows INODE, whose lock must be held and whose sectors must
+   already be allocated by allocate_to(), to LENGTH bytes, and
+   writes its inode back.  Does nothing if INODE is already that
+   long. */
+static void
+set_length (struct inode *inode, off_t length)
+{
+  if (length > inode->data.length)
+    {
+      inode->data.length = length;
+      cache_write (inode->sector, &inode->data);
+    }
+}
+
+/* Releases SECTOR and, if it is an index sector LEVEL levels
+   above the data, every sector it points to. */
+static void
+release_sectors (block_sector_t sector, int level)
+{
+  if (sector == 0)
+    return;
+
+  if (level > 0)
+    {
+      block_sector_t *ptrs = malloc (BLOCK_SECTOR_SIZE);
+      off_t i;
+
+      if (ptrs == NULL)
+        PANIC ("couldn't allocate index sector buffer");
+      cache_read (sector, ptrs);
+      for (i = 0; i < PTRS_PER_SECTOR; i++)
+        release_sectors (ptrs[i], level - 1);
+      free (ptrs);
+    }
+  free_map_release (sector, 1);
+}
+
+/* Releases every data and index sector of INODE, but not the
+   sector holding INODE itself. */
+static void
+release_data (struct inode *inode)
+{
+  size_t i;
+
+  for (i = 0; i < DIRECT_CNT; i++)
+    release_sectors (inode->data.sectors[i], 0);
+  release_sectors (inode->data.sectors[INDIRECT_IDX], 1);
+  release_sectors (inode->data.sectors[DBL_INDIRECT_IDX], 2);
+}
+
+static void readahead (struct inode *, off_t offset, off_t size);
+
 /* List of open inodes, so that opening a single inode twice
    returns the same `struct inode'. */
 static struct list open_inodes;
 
+/* Protects open_inodes.  Held shared to look an inode up,
+   exclusive to add or remove one. */
+static struct rwlock open_inodes_lock;
+
+/* Read-ahead statistics of inodes that have been closed,
+   protected by open_inodes_lock. */
+static long long ra_issued_cnt;         /* Sectors queued. */
+static long long ra_hit_cnt;            /* Queued sectors later read. */
+
+static struct inode *find_open_inode (block_sector_t);
+
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
   list_init (&open_inodes);
+  rwlock_init (&open_inodes_lock);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -84,23 +290,26 @@ inode_create (block_sector_t sector, off_t length)
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
-      disk_inode->length = length;
+      struct inode *inode;
+
+      /* Write an empty inode, then grow it to LENGTH. */
+      disk_inode->length = 0;
       disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start)) 
-        {
-          block_write (fs_device, sector, disk_inode);
-          if (sectors > 0) 
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-              
-              for (i = 0; i < sectors; i++) 
-                block_write (fs_device, disk_inode->start + i, zeros);
-            }
-          success = true; 
-        } 
+      cache_write (sector, disk_inode);
       free (disk_inode);
+
+      inode = inode_open (sector);
+      if (inode != NULL)
+        {
+          lock_acquire (&inode->lock);
+          success = allocate_to (inode, length);
+          if (success)
+            set_length (inode, length);
+          else
+            release_data (inode);
+          lock_release (&inode->lock);
+          inode_close (inode);
+        }
     }
   return success;
 }
@@ -111,42 +320,83 @@ inode_create (block_sector_t sector, off_t length)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
-  struct inode *inode;
+  struct inode *inode, *open;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
-    {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
-    }
+  rwlock_acquire_shared (&open_inodes_lock);
+  inode = find_open_inode (sector);
+  if (inode != NULL)
+    inode_reopen (inode);
+  rwlock_release (&open_inodes_lock);
+  if (inode != NULL)
+    return inode;
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
     return NULL;
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize, reading the inode without holding
+     open_inodes_lock so that opens of other inodes proceed. */
   inode->sector = sector;
   inode->open_cnt = 1;
+  lock_init (&inode->lock);
+  rwlock_init (&inode->dir_lock);
   inode->deny_write_cnt = 0;
+  inode->last_alloc = sector;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  inode->ra_next_ofs = 0;
+  inode->ra_window = 0;
+  inode->ra_frontier = 0;
+  inode->ra_issued = 0;
+  inode->ra_hits = 0;
+  cache_read (inode->sector, &inode->data);
+
+  /* Another thread may have opened it in the meantime. */
+  rwlock_acquire_exclusive (&open_inodes_lock);
+  open = find_open_inode (sector);
+  if (open != NULL)
+    inode_reopen (open);
+  else
+    list_push_front (&open_inodes, &inode->elem);
+  rwlock_release (&open_inodes_lock);
+  if (open != NULL)
+    {
+      free (inode);
+      return open;
+    }
   return inode;
 }
 
+/* Returns the open inode for SECTOR, or a null pointer if it
+   isn't open.  open_inodes_lock must be held. */
+static struct inode *
+find_open_inode (block_sector_t sector)
+{
+  struct list_elem *e;
+
+  ASSERT (rwlock_held_by_current_thread (&open_inodes_lock));
+
+  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
+       e = list_next (e)) 
+    {
+      struct inode *inode = list_entry (e, struct inode, elem);
+      if (inode->sector == sector) 
+        return inode;
+    }
+  return NULL;
+}
+
 /* Reopens and returns INODE. */
 struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&inode->lock);
+      inode->open_cnt++;
+      lock_release (&inode->lock);
+    }
   return inode;
 }
 
@@ -163,22 +413,46 @@ inode_get_inumber (const struct inode *inode)
 void
 inode_close (struct inode *inode) 
 {
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  /* Dropping another opener's reference doesn't touch the list. */
+  lock_acquire (&inode->lock);
+  if (inode->open_cnt > 1)
+    {
+      inode->open_cnt--;
+      lock_release (&inode->lock);
+      return;
+    }
+  lock_release (&inode->lock);
+
+  rwlock_acquire_exclusive (&open_inodes_lock);
+  lock_acquire (&inode->lock);
+  last = --inode->open_cnt == 0;
+  lock_release (&inode->lock);
+  if (last)
     {
-      /* Remove from inode list and release lock. */
       list_remove (&inode->elem);
- 
-      /* Deallocate blocks if removed. */
+      ra_issued_cnt += inode->ra_issued;
+      ra_hit_cnt += inode->ra_hits;
+    }
+  rwlock_release (&open_inodes_lock);
+
+  /* Release resources if this was the last opener.  Nothing else
+     can reach INODE any more. */
+  if (last)
+    {
+      /* Deallocate blocks if removed.  Data written through
+         INODE reaches the disk through the cache's flusher
+         thread, or at the latest when the file system is shut
+         down. */
       if (inode->removed) 
         {
+          release_data (inode);
           free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length)); 
         }
 
       free (inode); 
@@ -191,7 +465,9 @@ void
 inode_remove (struct inode *inode) 
 {
   ASSERT (inode != NULL);
+  lock_acquire (&inode->lock);
   inode->removed = true;
+  lock_release (&inode->lock);
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -202,16 +478,25 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+  unsigned hits = 0;
+
+  lock_acquire (&inode->lock);
+  readahead (inode, offset, size);
+  lock_release (&inode->lock);
 
   while (size > 0) 
     {
-      /* Disk sector to read, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+      off_t inode_left;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      /* Disk sector to read and bytes left in inode. */
+      lock_acquire (&inode->lock);
+      sector_idx = byte_to_sector (inode, offset);
+      inode_left = inode->data.length - offset;
+      lock_release (&inode->lock);
+
+      /* Bytes left in sector, lesser of the two. */
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -220,59 +505,70 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+      /* Copy straight out of the buffer cache. */
+      if (cache_read_at (sector_idx, buffer + bytes_read, sector_ofs,
+                         chunk_size))
+        hits++;
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
 
+  if (hits > 0)
+    {
+      lock_acquire (&inode->lock);
+      inode->ra_hits += hits;
+      lock_release (&inode->lock);
+    }
   return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+   A write past end of file extends the inode, filling any gap
+   with zeros.  The new length only takes effect once the data
+   is written, so that a concurrent reader never sees the
+   extended part of the file before its data.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the inode couldn't be extended because the
+   disk is full or an error occurs. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  off_t end = offset + size;
 
+  lock_acquire (&inode->lock);
   if (inode->deny_write_cnt)
-    return 0;
+    {
+      lock_release (&inode->lock);
+      return 0;
+    }
+
+  /* If the inode can't be extended, the loop below stops at the
+     current end of file. */
+  if (size > 0 && end > inode->data.length && !allocate_to (inode, end))
+    end = inode->data.length;
+  lock_release (&inode->lock);
 
   while (size > 0) 
     {
-      /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+      off_t inode_left;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      /* Sector to write and bytes left to write in the inode,
+         which may be past its current length. */
+      lock_acquire (&inode->lock);
+      sector_idx = get_data_sector (inode, offset / BLOCK_SECTOR_SIZE,
+                                    false);
+      lock_release (&inode->lock);
+      inode_left = end - offset;
+
+      /* Bytes left in sector, lesser of the two. */
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -281,39 +577,23 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
-        }
-      else 
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
-        }
+      /* Copy into the buffer cache, which reads in the rest of
+         the sector first if the chunk doesn't cover all of it. */
+      cache_write_at (sector_idx, buffer + bytes_written, sector_ofs,
+                      chunk_size);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
 
+  if (bytes_written > 0)
+    {
+      lock_acquire (&inode->lock);
+      set_length (inode, offset);
+      lock_release (&inode->lock);
+    }
   return bytes_written;
 }
 
@@ -322,8 +602,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 void
 inode_deny_write (struct inode *inode) 
 {
+  lock_acquire (&inode->lock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  lock_release (&inode->lock);
 }
 
 /* Re-enables writes to INODE.
@@ -332,14 +614,98 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  lock_acquire (&inode->lock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  lock_release (&inode->lock);
 }
 
-/* Returns the length, in bytes, of INODE's data. */
+/* Returns the length, in bytes, of INODE's data.  The length is
+   a single word, so it is read without taking INODE's lock. */
 off_t
 inode_length (const struct inode *inode)
 {
   return inode->data.length;
 }
+
+/* Returns the rwlock that protects the entries of directory
+   INODE.  Lookups hold it shared.  Updates hold it exclusive
+   across the lookup they depend on. */
+struct rwlock *
+inode_dir_lock (struct inode *inode)
+{
+  return &inode->dir_lock;
+}
+
+/* Prints read-ahead statistics, totaled over every inode opened
+   so far.  Like the other statistics printed at shutdown, these
+   are read without locking. */
+void
+inode_print_stats (void)
+{
+  long long issued = ra_issued_cnt;
+  long long hits = ra_hit_cnt;
+  struct list_elem *e;
+
+  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
+       e = list_next (e))
+    {
+      struct inode *inode = list_entry (e, struct inode, elem);
+      issued += inode->ra_issued;
+      hits += inode->ra_hits;
+    }
+  printf ("Inode: %lld sectors read ahead, %lld read\n", issued, hits);
+}
+
+/* Updates INODE's read-ahead state for a read of SIZE bytes at
+   OFFSET and queues read-ahead of the sectors that follow.
+   INODE's lock must be held.
+
+   A read that starts where the previous one ended is sequential
+   and doubles the read-ahead window, up to
+   READAHEAD_MAX_SECTORS.  Any other read closes the window until
+   the access pattern becomes sequential again. */
+static void
+readahead (struct inode *inode, off_t offset, off_t size)
+{
+  off_t first, last, end;
+
+  if (size <= 0)
+    return;
+
+  if (offset == inode->ra_next_ofs)
+    {
+      if (inode->ra_window == 0)
+        inode->ra_window = 1;
+      else if (inode->ra_window < READAHEAD_MAX_SECTORS)
+        inode->ra_window *= 2;
+    }
+  else
+    {
+      inode->ra_window = 0;
+      inode->ra_frontier = 0;
+    }
+  inode->ra_next_ofs = offset + size;
+  if (inode->ra_window == 0)
+    return;
+
+  /* Queue the sectors after the last one this read touches,
+     skipping those queued by earlier reads. */
+  last = (offset + size - 1) / BLOCK_SECTOR_SIZE;
+  first = last + 1 > inode->ra_frontier ? last + 1 : inode->ra_frontier;
+  end = last + 1 + inode->ra_window;
+  if (end > (off_t) bytes_to_sectors (inode_length (inode)))
+    end = bytes_to_sectors (inode_length (inode));
+  for (; first < end; first++)
+    {
+      block_sector_t sector = get_data_sector (inode, first, false);
+      if (sector != 0)
+        {
+          cache_prefetch (sector);
+          inode->ra_issued++;
+        }
+    }
+  if (end > inode->ra_frontier)
+    inode->ra_frontier = end;
+}
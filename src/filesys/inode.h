@@ -6,6 +6,7 @@
 #include "devices/block.h"
 
 struct bitmap;
+struct rwlock;
 
 void inode_init (void);
 bool inode_create (block_sector_t, off_t);
@@ -19,5 +20,7 @@ off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
+struct rwlock *inode_dir_lock (struct inode *);
+void inode_print_stats (void);
 
 #endif /* filesys/inode.h */
@@ -53,6 +53,15 @@ elem_cnt (size_t bit_cnt)
   return DIV_ROUND_UP (bit_cnt, ELEM_BITS);
 }
 
+/* Returns the index of the lowest set bit in nonzero ELEM.
+   Compiles to a single bit-scan instruction. */
+static inline size_t
+first_set_bit (elem_type elem)
+{
+  ASSERT (elem != 0);
+  return __builtin_ctzl (elem);
+}
+
 /* Returns the number of bytes required for BIT_CNT bits. */
 static inline size_t
 byte_cnt (size_t bit_cnt)
@@ -246,21 +255,47 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
   return value_cnt;
 }
 
+/* Returns the index of the first bit in B at or after START
+   that is set to VALUE, or B's size if there is none.
+   Examines a whole element at a time, skipping elements that
+   have no bit set to VALUE. */
+static size_t
+next_bit (const struct bitmap *b, size_t start, bool value)
+{
+  /* XORing with FLIP turns bits set to VALUE into 1s. */
+  elem_type flip = value ? 0 : (elem_type) -1;
+  size_t idx = elem_idx (start);
+  size_t end = elem_cnt (b->bit_cnt);
+  elem_type elem;
+
+  if (start >= b->bit_cnt)
+    return b->bit_cnt;
+
+  /* Ignore the bits before START in its element. */
+  elem = (b->bits[idx] ^ flip) & ~(bit_mask (start) - 1);
+  while (elem == 0)
+    {
+      if (++idx >= end)
+        return b->bit_cnt;
+      elem = b->bits[idx] ^ flip;
+    }
+
+  /* Bits past the end of the bitmap in the last element may
+     match, so clip the result. */
+  start = idx * ELEM_BITS + first_set_bit (elem);
+  return start < b->bit_cnt ? start : b->bit_cnt;
+}
+
 /* Returns true if any bits in B between START and START + CNT,
    exclusive, are set to VALUE, and false otherwise. */
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return cnt > 0 && next_bit (b, start, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -299,13 +334,31 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
+  if (cnt == 0)
+    return start;
   if (cnt <= b->bit_cnt) 
     {
       size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t i = start;
+
+      /* Alternate between finding the start of a run of VALUE
+         bits and finding its end, a word at a time, until a run
+         is long enough. */
+      for (;;)
+        {
+          size_t end;
+
+          i = next_bit (b, i, value);
+          if (i > last)
+            break;
+          if (cnt == 1)
+            return i;
+
+          end = next_bit (b, i, !value);
+          if (end - i >= cnt)
+            return i;
+          i = end;
+        }
     }
   return BITMAP_ERROR;
 }
@@ -359,6 +412,24 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the SIZE bytes of B's file image that start at byte
+   offset OFS to the same place in FILE, clipping the range to
+   the image's size.  Returns true if successful, false
+   otherwise. */
+bool
+bitmap_write_partial (const struct bitmap *b, struct file *file,
+                      size_t ofs, size_t size)
+{
+  size_t file_size = byte_cnt (b->bit_cnt);
+
+  if (ofs >= file_size)
+    return true;
+  if (size > file_size - ofs)
+    size = file_size - ofs;
+  return (file_write_at (file, (const uint8_t *) b->bits + ofs, size, ofs)
+          == (off_t) size);
+}
 #endif /* FILESYS */
 
 /* Debugging. */
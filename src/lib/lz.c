@@ -0,0 +1,198 @@
+#include <lz.h>
+#include <debug.h>
+#include <string.h>
+
+/* Compressed format.
+
+   Each sequence starts with a token byte.  Its high nibble is the
+   number of literal bytes and its low nibble the length of the
+   match less LZ_MIN_MATCH.  A nibble of 15 is followed by bytes
+   to add to it, each 255 meaning another byte follows.  Then come
+   the literal bytes and, except in the last sequence, the match's
+   offset back from the current output position, as 2 bytes
+   little-endian.  The match is then copied from earlier output,
+   and may overlap the bytes it produces.  The last sequence ends
+   the input. */
+
+/* Shortest match worth encoding. */
+#define LZ_MIN_MATCH 4
+
+/* Largest length held in a token nibble. */
+#define LZ_NIBBLE_MAX 15
+
+static inline uint32_t
+read32 (const uint8_t *p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof v);
+  return v;
+}
+
+/* Hashes the LZ_MIN_MATCH bytes V to a hash table index. */
+static inline unsigned
+hash (uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Appends to *OP, which must not pass END, the extra length bytes
+   for a token nibble holding LEN, which is at least LZ_NIBBLE_MAX.
+   Returns false if there is no room. */
+static bool
+put_length (uint8_t **op, const uint8_t *end, size_t len)
+{
+  len -= LZ_NIBBLE_MAX;
+  for (;;)
+    {
+      if (*op >= end)
+        return false;
+      if (len < 255)
+        {
+          *(*op)++ = len;
+          return true;
+        }
+      *(*op)++ = 255;
+      len -= 255;
+    }
+}
+
+/* Appends a sequence of LIT_LEN literal bytes from LITS followed,
+   unless MATCH_LEN is 0, by a match of MATCH_LEN bytes at OFFSET,
+   to *OP, which must not pass END.  Returns false if there is no
+   room. */
+static bool
+put_sequence (uint8_t **op, const uint8_t *end, const uint8_t *lits,
+              size_t lit_len, size_t offset, size_t match_len)
+{
+  size_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+  uint8_t *token = *op;
+
+  if (*op >= end)
+    return false;
+  *token = ((lit_len < LZ_NIBBLE_MAX ? lit_len : LZ_NIBBLE_MAX) << 4
+            | (match_code < LZ_NIBBLE_MAX ? match_code : LZ_NIBBLE_MAX));
+  (*op)++;
+  if (lit_len >= LZ_NIBBLE_MAX && !put_length (op, end, lit_len))
+    return false;
+  if ((size_t) (end - *op) < lit_len)
+    return false;
+  memcpy (*op, lits, lit_len);
+  *op += lit_len;
+  if (match_len == 0)
+    return true;
+
+  if (end - *op < 2)
+    return false;
+  *(*op)++ = offset & 0xff;
+  *(*op)++ = offset >> 8;
+  return match_code < LZ_NIBBLE_MAX || put_length (op, end, match_code);
+}
+
+/* Compresses the SRC_SIZE bytes at SRC, at most LZ_MAX_INPUT, into
+   the DST_SIZE bytes at DST, using the LZ_WORK_SIZE bytes at WORK as
+   scratch memory.  Returns the compressed size, or 0 if it would
+   take more than DST_SIZE bytes. */
+size_t
+lz_compress (const void *src_, size_t src_size,
+             void *dst_, size_t dst_size, void *work)
+{
+  const uint8_t *src = src_;
+  uint8_t *op = dst_;
+  const uint8_t *end = op + dst_size;
+  uint16_t *table = work;
+  size_t ip = 0, anchor = 0;
+
+  ASSERT (src_size <= LZ_MAX_INPUT);
+
+  /* Stale entries are harmless: every candidate is checked. */
+  memset (table, 0, LZ_WORK_SIZE);
+  while (ip + LZ_MIN_MATCH <= src_size)
+    {
+      uint32_t v = read32 (src + ip);
+      unsigned h = hash (v);
+      size_t cand = table[h];
+
+      table[h] = ip;
+      if (cand < ip && read32 (src + cand) == v)
+        {
+          size_t len = LZ_MIN_MATCH;
+          while (ip + len < src_size && src[cand + len] == src[ip + len])
+            len++;
+          if (!put_sequence (&op, end, src + anchor, ip - anchor,
+                             ip - cand, len))
+            return 0;
+          ip += len;
+          anchor = ip;
+        }
+      else
+        ip++;
+    }
+  if (!put_sequence (&op, end, src + anchor, src_size - anchor, 0, 0))
+    return 0;
+  return op - (uint8_t *) dst_;
+}
+
+/* Reads a length continued from a token nibble from *IP, which must
+   not pass END, adding it to *LEN.  Returns false if the input is
+   truncated. */
+static bool
+get_length (const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+  uint8_t b;
+  do
+    {
+      if (*ip >= end)
+        return false;
+      b = *(*ip)++;
+      *len += b;
+    }
+  while (b == 255);
+  return true;
+}
+
+/* Decompresses the SRC_SIZE bytes at SRC, produced by
+   lz_compress(), into the DST_SIZE bytes at DST.  Returns true if
+   that produced exactly DST_SIZE bytes, false if the input is
+   corrupt or of a different size. */
+bool
+lz_decompress (const void *src_, size_t src_size, void *dst_, size_t dst_size)
+{
+  const uint8_t *ip = src_;
+  const uint8_t *src_end = ip + src_size;
+  uint8_t *dst = dst_;
+  size_t op = 0;
+
+  while (ip < src_end)
+    {
+      uint8_t token = *ip++;
+      size_t lit_len = token >> 4;
+      size_t match_len = token & LZ_NIBBLE_MAX;
+      size_t offset, i;
+
+      if (lit_len == LZ_NIBBLE_MAX && !get_length (&ip, src_end, &lit_len))
+        return false;
+      if ((size_t) (src_end - ip) < lit_len || dst_size - op < lit_len)
+        return false;
+      memcpy (dst + op, ip, lit_len);
+      ip += lit_len;
+      op += lit_len;
+      if (ip == src_end)
+        break;
+
+      if (src_end - ip < 2)
+        return false;
+      offset = ip[0] | ip[1] << 8;
+      ip += 2;
+      if (match_len == LZ_NIBBLE_MAX && !get_length (&ip, src_end, &match_len))
+        return false;
+      match_len += LZ_MIN_MATCH;
+      if (offset == 0 || offset > op || dst_size - op < match_len)
+        return false;
+
+      /* Byte by byte, as the match may overlap its own output. */
+      for (i = 0; i < match_len; i++)
+        dst[op + i] = dst[op - offset + i];
+      op += match_len;
+    }
+  return op == dst_size;
+}
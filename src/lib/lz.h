@@ -0,0 +1,27 @@
+#ifndef __LIB_LZ_H
+#define __LIB_LZ_H
+
+/* Small LZ77-style compressor, in the manner of LZ4: the output is
+   a series of sequences, each a run of literal bytes followed by a
+   copy of earlier output.  Fast rather than thorough, for data such
+   as pages being swapped out. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bits of hash used to find earlier matches, and the size of the
+   scratch memory lz_compress() needs for its hash table. */
+#define LZ_HASH_BITS 10
+#define LZ_WORK_SIZE (sizeof (uint16_t) << LZ_HASH_BITS)
+
+/* Largest input lz_compress() accepts, as match offsets are 16
+   bits. */
+#define LZ_MAX_INPUT 65535
+
+size_t lz_compress (const void *src, size_t src_size,
+                    void *dst, size_t dst_size, void *work);
+bool lz_decompress (const void *src, size_t src_size,
+                    void *dst, size_t dst_size);
+
+#endif /* lib/lz.h */
@@ -0,0 +1,157 @@
+/* Test program and microbenchmark for bitmap scanning in
+   lib/kernel/bitmap.c.
+
+   Checks bitmap_scan() and bitmap_contains() against a simple
+   bit-by-bit reference on random bitmaps, then times both on a
+   large, mostly full bitmap of the kind that backs a big user
+   pool or swap partition.
+
+   This is not a test we will run on your submitted tasks.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <bitmap.h>
+#include <debug.h>
+#include <inttypes.h>
+#include <random.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "threads/test.h"
+
+/* Largest bitmap, in bits, used for checking correctness. */
+#define MAX_BITS 300
+
+/* Size of the bitmap used for timing, in bits, and number of
+   scans timed for each run length. */
+#define BENCH_BITS (64 * 1024)
+#define BENCH_SCANS 64
+
+static void fill_random (struct bitmap *, int percent_set);
+static size_t reference_scan (const struct bitmap *, size_t start,
+                              size_t cnt, bool value);
+static void verify_scans (void);
+static void benchmark (void);
+
+/* Test and time bitmap scanning. */
+void
+test (void)
+{
+  verify_scans ();
+  benchmark ();
+  printf ("done\n");
+}
+
+/* Compares bitmap_scan() and bitmap_contains() against
+   bit-by-bit references for bitmaps of every size up to
+   MAX_BITS bits and various densities. */
+static void
+verify_scans (void)
+{
+  size_t bit_cnt;
+
+  printf ("testing bitmap scans:");
+  for (bit_cnt = 0; bit_cnt <= MAX_BITS; bit_cnt++)
+    {
+      struct bitmap *b = bitmap_create (bit_cnt);
+      int percent;
+
+      ASSERT (b != NULL);
+      for (percent = 0; percent <= 100; percent += 10)
+        {
+          size_t start;
+
+          fill_random (b, percent);
+          for (start = 0; start <= bit_cnt; start++)
+            {
+              size_t cnt = random_ulong () % 10;
+              bool value = random_ulong () % 2;
+              size_t i;
+              bool found = false;
+
+              ASSERT (bitmap_scan (b, start, cnt, value)
+                      == reference_scan (b, start, cnt, value));
+
+              if (start + cnt > bit_cnt)
+                continue;
+              for (i = 0; i < cnt; i++)
+                if (bitmap_test (b, start + i) == value)
+                  found = true;
+              ASSERT (bitmap_contains (b, start, cnt, value) == found);
+            }
+        }
+      bitmap_destroy (b);
+      if (bit_cnt % 50 == 0)
+        printf (" %zu", bit_cnt);
+    }
+  printf (" done\n");
+}
+
+/* Times bitmap_scan() against reference_scan() for finding a
+   free run near the end of an otherwise full bitmap. */
+static void
+benchmark (void)
+{
+  static const size_t cnts[] = {1, 4, 32};
+  struct bitmap *b = bitmap_create (BENCH_BITS);
+  size_t i;
+
+  ASSERT (b != NULL);
+  fill_random (b, 100);
+  bitmap_set_multiple (b, BENCH_BITS - 100, 50, false);
+
+  for (i = 0; i < sizeof cnts / sizeof *cnts; i++)
+    {
+      size_t cnt = cnts[i];
+      int64_t start;
+      int64_t scan_ticks, reference_ticks;
+      int j;
+
+      start = timer_ticks ();
+      for (j = 0; j < BENCH_SCANS; j++)
+        ASSERT (bitmap_scan (b, 0, cnt, false) == BENCH_BITS - 100);
+      scan_ticks = timer_elapsed (start);
+
+      start = timer_ticks ();
+      for (j = 0; j < BENCH_SCANS; j++)
+        ASSERT (reference_scan (b, 0, cnt, false) == BENCH_BITS - 100);
+      reference_ticks = timer_elapsed (start);
+
+      printf ("%d scans for %zu free bits in %d bits: "
+              "%"PRId64" ticks word-at-a-time, %"PRId64" ticks bit-by-bit\n",
+              BENCH_SCANS, cnt, BENCH_BITS, scan_ticks, reference_ticks);
+    }
+  bitmap_destroy (b);
+}
+
+/* Sets each bit in B with probability PERCENT_SET / 100. */
+static void
+fill_random (struct bitmap *b, int percent_set)
+{
+  size_t i;
+
+  for (i = 0; i < bitmap_size (b); i++)
+    bitmap_set (b, i, (int) (random_ulong () % 100) < percent_set);
+}
+
+/* Returns the first index at or after START of CNT consecutive
+   bits in B set to VALUE, testing one bit at a time, or
+   BITMAP_ERROR if there is none.  This is how bitmap_scan()
+   used to work. */
+static size_t
+reference_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t i, j;
+
+  if (cnt > bitmap_size (b))
+    return BITMAP_ERROR;
+  for (i = start; i + cnt <= bitmap_size (b); i++)
+    {
+      for (j = 0; j < cnt; j++)
+        if (bitmap_test (b, i + j) != value)
+          break;
+      if (j == cnt)
+        return i;
+    }
+  return BITMAP_ERROR;
+}
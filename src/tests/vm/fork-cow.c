@@ -0,0 +1,47 @@
+/* Forks a child that writes to a global variable and to a page
+   of its stack, then checks that the parent's copies of both are
+   unchanged.  The pages start out shared copy-on-write, so the
+   child's writes must go to copies of its own. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static int global = 0x1234;
+
+void
+test_main (void)
+{
+  char stack_page[4096];
+  pid_t child;
+  size_t i;
+
+  memset (stack_page, 'p', sizeof stack_page);
+
+  child = fork ();
+  if (child == 0)
+    {
+      msg ("child: write global and stack");
+      global = 0x5678;
+      memset (stack_page, 'c', sizeof stack_page);
+      if (global != 0x5678)
+        fail ("child reads global as %#x, not 0x5678", global);
+      for (i = 0; i < sizeof stack_page; i++)
+        if (stack_page[i] != 'c')
+          fail ("child reads stack byte %zu as '%c', not 'c'",
+                i, stack_page[i]);
+      exit (81);
+    }
+  if (child == PID_ERROR)
+    fail ("fork failed");
+
+  CHECK (wait (child) == 81, "wait for child");
+  msg ("check parent's global and stack");
+  if (global != 0x1234)
+    fail ("parent reads global as %#x, not 0x1234", global);
+  for (i = 0; i < sizeof stack_page; i++)
+    if (stack_page[i] != 'p')
+      fail ("parent reads stack byte %zu as '%c', not 'p'",
+            i, stack_page[i]);
+}
@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(fork-cow) begin
+(fork-cow) child: write global and stack
+fork-cow: exit(81)
+(fork-cow) wait for child
+(fork-cow) check parent's global and stack
+(fork-cow) end
+fork-cow: exit(0)
+EOF
+pass;
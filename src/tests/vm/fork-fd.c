@@ -0,0 +1,46 @@
+/* Reads part of a file, then forks.  The child checks that it
+   inherited the file descriptor at the same position, then seeks
+   back to the start and reads again.  The parent checks that
+   the child's seek didn't move its own position. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FIRST_PART 100
+
+void
+test_main (void)
+{
+  char buf[sizeof sample];
+  size_t rest = strlen (sample) - FIRST_PART;
+  int handle;
+  pid_t child;
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  CHECK (read (handle, buf, FIRST_PART) == FIRST_PART, "read first part");
+
+  child = fork ();
+  if (child == 0)
+    {
+      msg ("child: check position");
+      if (tell (handle) != FIRST_PART)
+        fail ("child's position is %u, not %d", tell (handle), FIRST_PART);
+      msg ("child: seek to start and read");
+      seek (handle, 0);
+      if (read (handle, buf, FIRST_PART) != FIRST_PART)
+        fail ("child's read failed");
+      compare_bytes (buf, sample, FIRST_PART, 0, "sample.txt");
+      exit (83);
+    }
+  if (child == PID_ERROR)
+    fail ("fork failed");
+
+  CHECK (wait (child) == 83, "wait for child");
+  CHECK (tell (handle) == FIRST_PART, "check parent's position");
+  CHECK (read (handle, buf, rest) == (int) rest, "read rest");
+  compare_bytes (buf, sample + FIRST_PART, rest, FIRST_PART, "sample.txt");
+  close (handle);
+}
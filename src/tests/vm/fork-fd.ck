@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(fork-fd) begin
+(fork-fd) open "sample.txt"
+(fork-fd) read first part
+(fork-fd) child: check position
+(fork-fd) child: seek to start and read
+fork-fd: exit(83)
+(fork-fd) wait for child
+(fork-fd) check parent's position
+(fork-fd) read rest
+(fork-fd) end
+fork-fd: exit(0)
+EOF
+pass;
@@ -0,0 +1,51 @@
+/* Fills 2 MB of memory, more than fits in the user pool, so
+   that much of it is swapped out, and then forks.  The child
+   checks that it sees the data and overwrites part of it; the
+   parent then checks that its own data is unchanged. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (2 * 1024 * 1024)
+
+static char buf[SIZE];
+
+/* Checks that BUF holds the pattern written by test_main(). */
+static void
+check_pattern (void)
+{
+  size_t i;
+
+  for (i = 0; i < SIZE; i++)
+    if (buf[i] != (char) (i % 251))
+      fail ("byte %zu is %02hhx, not %02hhx", i, buf[i], (char) (i % 251));
+}
+
+void
+test_main (void)
+{
+  pid_t child;
+  size_t i;
+
+  msg ("initialize");
+  for (i = 0; i < SIZE; i++)
+    buf[i] = i % 251;
+
+  child = fork ();
+  if (child == 0)
+    {
+      msg ("child: read pass");
+      check_pattern ();
+      msg ("child: write pass");
+      for (i = 0; i < SIZE; i += 4096)
+        buf[i] = ~buf[i];
+      exit (82);
+    }
+  if (child == PID_ERROR)
+    fail ("fork failed");
+
+  CHECK (wait (child) == 82, "wait for child");
+  msg ("read pass");
+  check_pattern ();
+}
@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(fork-swap) begin
+(fork-swap) initialize
+(fork-swap) child: read pass
+(fork-swap) child: write pass
+fork-swap: exit(82)
+(fork-swap) wait for child
+(fork-swap) read pass
+(fork-swap) end
+fork-swap: exit(0)
+EOF
+pass;
@@ -25,6 +25,7 @@
 #ifdef USERPROG
 #include "userprog/process.h"
 #include "userprog/exception.h"
+#include "userprog/fd.h"
 #include "userprog/gdt.h"
 #include "userprog/syscall.h"
 #include "userprog/tss.h"
@@ -38,6 +39,7 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -57,6 +59,9 @@ static bool format_filesys;
    overriding the defaults. */
 static const char *filesys_bdev_name;
 static const char *scratch_bdev_name;
+
+/* -cache: Number of sectors in the buffer cache. */
+static size_t cache_sector_cnt = CACHE_DEFAULT_SECTORS;
 #ifdef VM
 static const char *swap_bdev_name;
 #endif
@@ -65,6 +70,16 @@ static const char *swap_bdev_name;
 /* -ul: Maximum number of pages to put into palloc's user pool. */
 static size_t user_page_limit = SIZE_MAX;
 
+#ifdef VM
+/* -lowat, -hiwat: Free user frame watermarks for the page-out
+   daemon. */
+static size_t frame_low_watermark = FRAME_DEFAULT_LOW_WATERMARK;
+static size_t frame_high_watermark = FRAME_DEFAULT_HIGH_WATERMARK;
+
+/* -zswap: Kernel pages for the compressed swap pool, 0 for none. */
+static size_t zswap_pool_pages;
+#endif
+
 static void bss_init (void);
 static void paging_init (void);
 
@@ -132,14 +147,15 @@ main (void)
   /* Initialize file system. */
   ide_init ();
   locate_block_devices ();
+  cache_init (cache_sector_cnt);
   filesys_init (format_filesys);
 #endif
 
 #ifdef VM
   /* Initialise the swap disk */  
-  swap_init ();
+  swap_init (zswap_pool_pages);
   /* Initialise Frame Table*/
-  initialise_frame();
+  initialise_frame (frame_low_watermark, frame_high_watermark);
   /* Initialise Memory Mapped File structs*/
   init_mmap_lock();
 #endif
@@ -166,10 +182,21 @@ bss_init (void)
   memset (&_start_bss, 0, &_end_bss - &_start_bss);
 }
 
+/* CR4 page global enable: PTEs marked PTE_G are not flushed
+   from the TLB when CR3 is loaded. */
+#define CR4_PGE 0x00000080
+
+/* CPUID leaf 1 EDX feature bit for CR4_PGE support. */
+#define CPUID_PGE 0x00002000
+
 /* Populates the base page directory and page table with the
    kernel virtual mapping, and then sets up the CPU to use the
    new page directory.  Points init_page_dir to the page
-   directory it creates. */
+   directory it creates.
+
+   The kernel mapping is the same in every page directory, so it
+   is marked global: a switch between address spaces then only
+   flushes user mappings from the TLB. */
 static void
 paging_init (void)
 {
@@ -193,7 +220,7 @@ paging_init (void)
           pd[pde_idx] = pde_create (pt);
         }
 
-      pt[pte_idx] = pte_create_kernel (vaddr, !in_kernel_text);
+      pt[pte_idx] = pte_create_kernel (vaddr, !in_kernel_text) | PTE_G;
     }
 
   /* Store the physical address of the page directory into CR3
@@ -202,6 +229,18 @@ paging_init (void)
      to/from Control Registers" and [IA32-v3a] 3.7.5 "Base Address
      of the Page Directory". */
   asm volatile ("movl %0, %%cr3" : : "r" (vtop (init_page_dir)));
+
+  /* Enable global pages if the CPU has them.  Without CR4_PGE the
+     PTE_G bits are ignored.  See [IA32-v3a] 3.12 "Translation
+     Lookaside Buffers (TLBs)". */
+  uint32_t eax = 1, ebx, ecx, edx;
+  asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+  if (edx & CPUID_PGE)
+    {
+      uint32_t cr4;
+      asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+      asm volatile ("movl %0, %%cr4" : : "r" (cr4 | CR4_PGE) : "memory");
+    }
 }
 
 /* Breaks the kernel command line into words and returns them as
@@ -263,6 +302,8 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        cache_sector_cnt = atoi (value);
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -272,9 +313,28 @@ parse_options (char **argv)
         random_init (atoi (value));
       else if (!strcmp (name, "-mlfqs"))
         thread_mlfqs = true;
+      else if (!strcmp (name, "-tickless"))
+        timer_tickless = true;
 #ifdef USERPROG
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
+      else if (!strcmp (name, "-fdlimit"))
+        fd_limit = atoi (value);
+#endif
+#ifdef VM
+      else if (!strcmp (name, "-lowat"))
+        frame_low_watermark = atoi (value);
+      else if (!strcmp (name, "-hiwat"))
+        frame_high_watermark = atoi (value);
+      else if (!strcmp (name, "-zswap"))
+        zswap_pool_pages = atoi (value);
+      else if (!strcmp (name, "-faultaround"))
+        {
+          int pages = atoi (value);
+          fault_around_pages = (pages < 1 ? 1
+                                : pages > FAULT_AROUND_MAX_PAGES ? FAULT_AROUND_MAX_PAGES
+                                : pages);
+        }
 #endif
       else
         PANIC ("unknown option `%s' (use -h for help)", name);
@@ -389,14 +449,23 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=SECTORS     Cache SECTORS file system sectors in RAM.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
 #endif
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
+          "  -tickless          Stop the timer tick while idle.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
+          "  -fdlimit=COUNT     Limit processes to COUNT file descriptors.\n"
+#endif
+#ifdef VM
+          "  -lowat=COUNT       Start paging out below COUNT free user pages.\n"
+          "  -hiwat=COUNT       Page out until COUNT user pages are free.\n"
+          "  -zswap=PAGES       Compress swapped pages into PAGES kernel pages.\n"
+          "  -faultaround=PAGES Map up to PAGES file pages per page fault.\n"
 #endif
           );
   shutdown_power_off ();
@@ -359,6 +359,9 @@ intr_handler (struct intr_frame *frame)
 
       in_external_intr = true;
       yield_on_return = false;
+
+      /* Catch up on timer ticks skipped by tickless idle. */
+      timer_idle_exit ();
     }
 
   /* Invoke the interrupt's handler. */
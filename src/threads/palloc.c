@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/loader.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -32,6 +33,7 @@ struct pool
     struct lock lock;                   /* Mutual exclusion. */
     struct bitmap *used_map;            /* Bitmap of free pages. */
     uint8_t *base;                      /* Base of pool. */
+    size_t free_cnt;                    /* Number of free pages. */
   };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -40,6 +42,7 @@ static struct pool kernel_pool, user_pool;
 static void init_pool (struct pool *, void *base, size_t page_cnt,
                        const char *name);
 static bool page_from_pool (const struct pool *, void *page);
+static void adjust_free_cnt (struct pool *, int delta);
 
 /* Initializes the page allocator.  At most USER_PAGE_LIMIT
    pages are put into the user pool. */
@@ -80,6 +83,8 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 
   lock_acquire (&pool->lock);
   page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+  if (page_idx != BITMAP_ERROR)
+    adjust_free_cnt (pool, -(int) page_cnt);
   lock_release (&pool->lock);
 
   if (page_idx != BITMAP_ERROR)
@@ -141,6 +146,7 @@ palloc_free_multiple (void *pages, size_t page_cnt)
 
   ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
   bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+  adjust_free_cnt (pool, page_cnt);
 }
 
 /* Frees the page at PAGE. */
@@ -151,6 +157,15 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
+/* Returns the number of free pages in the user pool.  The
+   result is only a snapshot: other threads may allocate or free
+   user pages at any time. */
+size_t
+palloc_user_free_cnt (void)
+{
+  return user_pool.free_cnt;
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void
@@ -170,6 +185,19 @@ init_pool (struct pool *p, void *base, size_t page_cnt, const char *name)
   lock_init (&p->lock);
   p->used_map = bitmap_create_in_buf (page_cnt, base, bm_pages * PGSIZE);
   p->base = base + bm_pages * PGSIZE;
+  p->free_cnt = page_cnt;
+}
+
+/* Adds DELTA to POOL's count of free pages.  Pages may be freed
+   with interrupts off (see thread_schedule_tail()), where the
+   pool lock cannot be taken, so interrupts are disabled
+   instead. */
+static void
+adjust_free_cnt (struct pool *pool, int delta)
+{
+  enum intr_level old_level = intr_disable ();
+  pool->free_cnt += delta;
+  intr_set_level (old_level);
 }
 
 /* Returns true if PAGE was allocated from POOL,
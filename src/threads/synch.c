@@ -29,6 +29,7 @@
 #include "threads/synch.h"
 #include <stdio.h>
 #include <string.h>
+#include "devices/timer.h"
 #include "threads/interrupt.h"
 #include "threads/thread.h"
 
@@ -75,6 +76,70 @@ sema_down (struct semaphore *sema)
   intr_set_level (old_level);
 }
 
+/* Thread waiting in sema_down_timeout(). */
+struct sema_timed_waiter
+  {
+    struct thread *thread;      /* The waiting thread. */
+    bool timed_out;             /* Set when the timeout wakes it. */
+  };
+
+/* Timeout function for sema_down_timeout().  If the waiting
+   thread is still blocked, then it is blocked on the semaphore,
+   so takes it off the semaphore's waiters and wakes it up.
+   Otherwise sema_up() already woke it and there's nothing to
+   do. */
+static void
+sema_timeout_expired (struct timer_timeout *timeout UNUSED, void *waiter_)
+{
+  struct sema_timed_waiter *waiter = waiter_;
+  struct thread *t = waiter->thread;
+
+  if (t->status == THREAD_BLOCKED)
+    {
+      list_remove (&t->elem);
+      waiter->timed_out = true;
+      thread_unblock (t);
+    }
+}
+
+/* Down or "P" operation on a semaphore that gives up after
+   TICKS timer ticks.  Returns true if SEMA's value was
+   decremented, false if the wait timed out.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+bool
+sema_down_timeout (struct semaphore *sema, int64_t ticks)
+{
+  int64_t deadline = timer_ticks () + ticks;
+  struct sema_timed_waiter waiter;
+  struct timer_timeout timeout;
+  enum intr_level old_level;
+  bool success;
+
+  ASSERT (sema != NULL);
+  ASSERT (!intr_context ());
+
+  waiter.thread = thread_current ();
+  waiter.timed_out = false;
+  timer_timeout_init (&timeout, sema_timeout_expired, &waiter);
+
+  old_level = intr_disable ();
+  while (sema->value == 0 && !waiter.timed_out
+         && timer_ticks () < deadline)
+    {
+      list_push_back (&sema->waiters, &thread_current ()->elem);
+      timer_timeout_add (&timeout, deadline);
+      thread_block ();
+      timer_timeout_cancel (&timeout);
+    }
+  success = sema->value > 0;
+  if (success)
+    sema->value--;
+  intr_set_level (old_level);
+  return success;
+}
+
 /* Down or "P" operation on a semaphore, but only if the
    semaphore is not already 0.  Returns true if the semaphore is
    decremented, false otherwise.
@@ -116,6 +181,13 @@ sema_up (struct semaphore *sema)
   next = NULL;
   old_level = intr_disable ();
   if (!list_empty (&sema->waiters)) {
+    // Waiters' MLFQS priorities may be stale while they are blocked
+    if (thread_mlfqs) {
+      struct list_elem *e;
+      for (e = list_begin (&sema->waiters); e != list_end (&sema->waiters);
+           e = list_next (e))
+        thread_mlfqs_refresh (list_entry (e, struct thread, elem));
+    }
     struct list_elem * elem = list_remove_max (&sema->waiters, thread_prio_list_less);
     next = (list_entry (elem, struct thread, elem));
     thread_unblock(next);
@@ -319,6 +391,236 @@ lock_held_by_current_thread (const struct lock *lock)
   return lock->holder == thread_current ();
 }
 
+ 
+/* A thread waiting for an rwlock. */
+struct rwlock_waiter 
+  {
+    struct list_elem elem;              /* Element in rwlock's waiters. */
+    struct thread *thread;              /* Waiting thread. */
+    bool exclusive;                     /* Waiting to write? */
+    struct semaphore semaphore;         /* Upped once granted. */
+  };
+
+static void rwlock_acquire (struct rwlock *, bool exclusive);
+static void rwlock_grant (struct rwlock *, struct thread *, bool exclusive);
+static struct rwlock_hold *rwlock_find_hold (struct thread *,
+                                             const struct rwlock *);
+
+/* Initializes RWLOCK, which is initially not held. */
+void
+rwlock_init (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  list_init (&rwlock->holders);
+  list_init (&rwlock->waiters);
+  rwlock->reader_cnt = 0;
+  rwlock->writer = false;
+  rwlock->writer_wait_cnt = 0;
+}
+
+/* Acquires RWLOCK shared, sleeping while it is held exclusive or
+   a writer is waiting for it.  The rwlock must not already be
+   held by the current thread.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_acquire_shared (struct rwlock *rwlock)
+{
+  rwlock_acquire (rwlock, false);
+}
+
+/* Acquires RWLOCK exclusive, sleeping until no other thread holds
+   it.  The rwlock must not already be held by the current
+   thread.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_acquire_exclusive (struct rwlock *rwlock)
+{
+  rwlock_acquire (rwlock, true);
+}
+
+/* Acquires RWLOCK, EXCLUSIVE or shared.  While waiting, the
+   current thread donates its priority to every holder, as
+   lock_acquire() does to a lock's holder. */
+static void
+rwlock_acquire (struct rwlock *rwlock, bool exclusive)
+{
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+  bool available;
+
+  ASSERT (rwlock != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rwlock_held_by_current_thread (rwlock));
+
+  old_level = intr_disable ();
+  if (exclusive)
+    available = !rwlock->writer && rwlock->reader_cnt == 0;
+  else
+    available = !rwlock->writer && rwlock->writer_wait_cnt == 0;
+
+  if (available)
+    rwlock_grant (rwlock, cur, exclusive);
+  else
+    {
+      struct rwlock_waiter waiter;
+      struct list_elem *e;
+
+      waiter.thread = cur;
+      waiter.exclusive = exclusive;
+      sema_init (&waiter.semaphore, 0);
+      list_push_back (&rwlock->waiters, &waiter.elem);
+      if (exclusive)
+        rwlock->writer_wait_cnt++;
+      cur->rwlock_waiting = rwlock;
+
+      if (!thread_mlfqs)
+        for (e = list_begin (&rwlock->holders); e != list_end (&rwlock->holders);
+             e = list_next (e))
+          thread_update_effective_priority_no_yield
+            (list_entry (e, struct rwlock_hold, elem)->thread);
+
+      /* rwlock_release() grants RWLOCK to us before waking us. */
+      sema_down (&waiter.semaphore);
+
+      /* Waiters left behind now donate to us. */
+      if (!thread_mlfqs)
+        thread_update_effective_priority (cur);
+    }
+  intr_set_level (old_level);
+}
+
+/* Releases RWLOCK, which must be held by the current thread.  If
+   that leaves it free, hands it to the highest priority waiting
+   writer or, if there is none, to all waiting readers. */
+void
+rwlock_release (struct rwlock *rwlock)
+{
+  struct thread *cur = thread_current ();
+  struct rwlock_hold *hold;
+  enum intr_level old_level;
+
+  ASSERT (rwlock != NULL);
+
+  old_level = intr_disable ();
+  hold = rwlock_find_hold (cur, rwlock);
+  ASSERT (hold != NULL);
+  list_remove (&hold->elem);
+  hold->rwlock = NULL;
+  if (rwlock->writer)
+    rwlock->writer = false;
+  else
+    rwlock->reader_cnt--;
+
+  /* Stop receiving donations through RWLOCK. */
+  if (!thread_mlfqs)
+    thread_update_effective_priority_no_yield (cur);
+
+  if (!rwlock->writer && rwlock->reader_cnt == 0
+      && !list_empty (&rwlock->waiters))
+    {
+      struct list_elem *e, *next;
+
+      if (rwlock->writer_wait_cnt > 0)
+        {
+          struct rwlock_waiter *best = NULL;
+
+          for (e = list_begin (&rwlock->waiters);
+               e != list_end (&rwlock->waiters); e = list_next (e))
+            {
+              struct rwlock_waiter *w = list_entry (e, struct rwlock_waiter,
+                                                    elem);
+              if (w->exclusive
+                  && (best == NULL || w->thread->effective_priority
+                                      > best->thread->effective_priority))
+                best = w;
+            }
+          list_remove (&best->elem);
+          rwlock->writer_wait_cnt--;
+          best->thread->rwlock_waiting = NULL;
+          rwlock_grant (rwlock, best->thread, true);
+          sema_up (&best->semaphore);
+        }
+      else
+        for (e = list_begin (&rwlock->waiters);
+             e != list_end (&rwlock->waiters); e = next)
+          {
+            struct rwlock_waiter *w = list_entry (e, struct rwlock_waiter,
+                                                  elem);
+            next = list_remove (e);
+            w->thread->rwlock_waiting = NULL;
+            rwlock_grant (rwlock, w->thread, false);
+            sema_up (&w->semaphore);
+          }
+    }
+  intr_set_level (old_level);
+}
+
+/* Returns true if the current thread holds RWLOCK, shared or
+   exclusive, false otherwise. */
+bool
+rwlock_held_by_current_thread (const struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  return rwlock_find_hold (thread_current (), rwlock) != NULL;
+}
+
+/* Returns the highest effective priority among the threads
+   waiting for RWLOCK, or PRI_MIN if there are none. */
+int
+rwlock_donated_priority (struct rwlock *rwlock)
+{
+  struct list_elem *e;
+  int priority = PRI_MIN;
+
+  for (e = list_begin (&rwlock->waiters); e != list_end (&rwlock->waiters);
+       e = list_next (e))
+    {
+      struct rwlock_waiter *w = list_entry (e, struct rwlock_waiter, elem);
+      if (w->thread->effective_priority > priority)
+        priority = w->thread->effective_priority;
+    }
+  return priority;
+}
+
+/* Makes T a holder of RWLOCK, EXCLUSIVE or shared, which must be
+   available to it.  Interrupts must be off. */
+static void
+rwlock_grant (struct rwlock *rwlock, struct thread *t, bool exclusive)
+{
+  struct rwlock_hold *hold = rwlock_find_hold (t, NULL);
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  if (hold == NULL)
+    PANIC ("thread %s holds more than %d rwlocks", t->name, RWLOCK_HOLD_MAX);
+
+  hold->rwlock = rwlock;
+  hold->thread = t;
+  list_push_back (&rwlock->holders, &hold->elem);
+  if (exclusive)
+    rwlock->writer = true;
+  else
+    rwlock->reader_cnt++;
+}
+
+/* Returns T's hold on RWLOCK, or an unused hold if RWLOCK is
+   null, or a null pointer if there is none. */
+static struct rwlock_hold *
+rwlock_find_hold (struct thread *t, const struct rwlock *rwlock)
+{
+  int i;
+
+  for (i = 0; i < RWLOCK_HOLD_MAX; i++)
+    if (t->rwlock_holds[i].rwlock == rwlock)
+      return &t->rwlock_holds[i];
+  return NULL;
+}
+
 /* One semaphore in a list. */
 struct semaphore_elem 
   {
@@ -382,6 +684,39 @@ cond_wait (struct condition *cond, struct lock *lock)
 
 
 
+/* Like cond_wait(), but gives up waiting after TICKS timer
+   ticks.  Returns true if COND was signaled, false if the wait
+   timed out.  Either way, LOCK is held again on return. */
+bool
+cond_wait_timeout (struct condition *cond, struct lock *lock, int64_t ticks)
+{
+  struct semaphore_elem waiter;
+  bool signaled;
+
+  ASSERT (cond != NULL);
+  ASSERT (lock != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (lock_held_by_current_thread (lock));
+  
+  waiter.sema_prio = thread_current()->effective_priority;
+  sema_init (&waiter.semaphore, 0);
+  list_push_back (&cond->waiters, &waiter.elem);
+  lock_release (lock);
+  signaled = sema_down_timeout (&waiter.semaphore, ticks);
+  lock_acquire (lock);
+
+  /* A signal may have arrived between the timeout and
+     reacquiring LOCK, in which case cond_signal() already took
+     us off COND's waiters. */
+  if (!signaled)
+    {
+      signaled = sema_try_down (&waiter.semaphore);
+      if (!signaled)
+        list_remove (&waiter.elem);
+    }
+  return signaled;
+}
+
 /* If any threads are waiting on COND (protected by LOCK), then
    this function signals one of them to wake up from its wait.
    LOCK must be held before calling this function.
@@ -3,6 +3,7 @@
 
 #include <list.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* A counting semaphore. */
 struct semaphore 
@@ -13,6 +14,7 @@ struct semaphore
 
 void sema_init (struct semaphore *, unsigned value);
 void sema_down (struct semaphore *);
+bool sema_down_timeout (struct semaphore *, int64_t ticks);
 bool sema_try_down (struct semaphore *);
 void sema_up (struct semaphore *);
 void sema_self_test (void);
@@ -31,6 +33,39 @@ bool lock_try_acquire (struct lock *);
 void lock_release (struct lock *);
 bool lock_held_by_current_thread (const struct lock *);
 
+/* Reader-writer lock: held either shared, by any number of
+   readers, or exclusive, by a single writer.  Writers are
+   preferred: once a writer is waiting, new readers wait behind
+   it.  Waiters donate their priority to every holder. */
+struct rwlock 
+  {
+    struct list holders;        /* rwlock_holds of the holding threads. */
+    struct list waiters;        /* Waiting threads (synch.c). */
+    unsigned reader_cnt;        /* Number of shared holders. */
+    bool writer;                /* Held exclusive? */
+    unsigned writer_wait_cnt;   /* Number of waiting writers. */
+  };
+
+/* Most rwlocks a thread may hold at once. */
+#define RWLOCK_HOLD_MAX 4
+
+/* A thread's hold on an rwlock.  Each thread has RWLOCK_HOLD_MAX
+   of these, so that it can find the rwlocks it holds and an
+   rwlock can find its holders, for priority donation. */
+struct rwlock_hold 
+  {
+    struct list_elem elem;      /* Element in the rwlock's holders. */
+    struct rwlock *rwlock;      /* Held rwlock, or null if unused. */
+    struct thread *thread;      /* Holding thread. */
+  };
+
+void rwlock_init (struct rwlock *);
+void rwlock_acquire_shared (struct rwlock *);
+void rwlock_acquire_exclusive (struct rwlock *);
+void rwlock_release (struct rwlock *);
+bool rwlock_held_by_current_thread (const struct rwlock *);
+int rwlock_donated_priority (struct rwlock *);
+
 /* Condition variable. */
 struct condition 
   {
@@ -39,6 +74,7 @@ struct condition
 
 void cond_init (struct condition *);
 void cond_wait (struct condition *, struct lock *);
+bool cond_wait_timeout (struct condition *, struct lock *, int64_t ticks);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
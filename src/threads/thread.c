@@ -15,6 +15,7 @@
 #include "devices/timer.h"
 #include "threads/malloc.h"
 #ifdef USERPROG
+#include "userprog/fd.h"
 #include "userprog/process.h"
 #include "vm/page.h"
 #endif
@@ -24,9 +25,16 @@
    of thread.h for details. */
 #define THREAD_MAGIC 0xcd6abf4b
 
-/* List of processes in THREAD_READY state, that is, processes
-   that are ready to run but not actually running. */
-static struct list ready_list;
+/* Processes in THREAD_READY state, that is, processes that are
+   ready to run but not actually running, in one FIFO run queue
+   per effective priority.  Bit P of ready_mask is set when
+   ready_queues[P] is nonempty, so the highest priority with a
+   ready thread is found with a bit scan.  The 64-bit mask is
+   kept as two 32-bit words, the high word covering priorities
+   32 through 63.  Accessed only with interrupts off. */
+static struct list ready_queues[PRI_MAX + 1];
+static uint32_t ready_mask[2];
+static size_t ready_cnt;        /* Number of ready threads. */
 
 /* List of all processes.  Processes are added to this list
    when they are first scheduled and removed when they exit. */
@@ -53,6 +61,7 @@ struct kernel_thread_frame
 static long long idle_ticks;    /* # of timer ticks spent idle. */
 static long long kernel_ticks;  /* # of timer ticks in kernel threads. */
 static long long user_ticks;    /* # of timer ticks in user programs. */
+static long long switch_cnt;    /* # of switches between threads. */
 static int32_t load_avg;        /* System wide load_avg left in FP form*/
 
 /* Scheduling. */
@@ -62,6 +71,22 @@ static unsigned thread_ticks;   /* # of timer ticks since last yield. */
 #define LOAD_AVG_FRACTION FP_DIV_INT(INTEGER_TO_FP(59), 60)
 #define READY_THREADS_FRACTION FP_DIV_INT(INTEGER_TO_FP(1), 60)
 
+/* MLFQS recent_cpu decay.
+
+   Once a second every thread's recent_cpu decays by a
+   coefficient that depends only on load_avg.  Running and ready
+   threads are decayed on the spot.  A blocked thread's
+   recent_cpu can't change otherwise, so its decay is deferred
+   until it is unblocked, replaying the coefficients of the
+   seconds it missed from decay_history.  Threads stay deferred
+   for at most DECAY_HISTORY seconds: deferred_list is ordered by
+   recent_cpu_epoch, and threads that reach the limit are caught
+   up by the once-a-second update. */
+#define DECAY_HISTORY 64
+static int32_t decay_history[DECAY_HISTORY]; /* Coefficient by second. */
+static int64_t mlfqs_seconds;   /* Number of once-a-second updates. */
+static struct list deferred_list;
+
 
 /* If false (default), use round-robin scheduler.
    If true, use multi-level feedback queue scheduler.
@@ -79,6 +104,13 @@ static void *alloc_frame (struct thread *, size_t size);
 static void schedule (void);
 void thread_schedule_tail (struct thread *prev);
 static tid_t allocate_tid (void);
+static void ready_queue_push (struct thread *);
+static void ready_queue_remove (struct thread *);
+static int ready_queue_max_priority (void);
+static void set_effective_priority (struct thread *, int priority);
+static void mlfqs_second (void);
+static void mlfqs_catch_up (struct thread *);
+static void decay_recent_cpu (struct thread *);
 
 #ifdef USERPROG
 static void process_exit_status_init(struct process_exit_status *status, int pid);
@@ -134,17 +166,38 @@ bool thread_prio_list_less(const struct list_elem *a,
 
 static void thread_update_effective_priority_depth(struct thread  *t, int depth) {
   ASSERT(!intr_context());
-  t->effective_priority = t->priority;
+  int new_priority = t->priority;
+  int i;
 
   if (!list_empty(&t->donations))
-    t->effective_priority = list_entry(list_max(&t->donations, thread_elem_prio_list_less, NULL),
-                                       struct thread_elem, elem)->thread->effective_priority;
+    new_priority = list_entry(list_max(&t->donations, thread_elem_prio_list_less, NULL),
+                              struct thread_elem, elem)->thread->effective_priority;
   
-  if (t->effective_priority < t->priority)
-    t->effective_priority = t->priority;
+  // Waiters for rwlocks T holds donate too
+  for (i = 0; i < RWLOCK_HOLD_MAX; i++)
+    if (t->rwlock_holds[i].rwlock != NULL) {
+      int donated = rwlock_donated_priority(t->rwlock_holds[i].rwlock);
+      if (new_priority < donated)
+        new_priority = donated;
+    }
+
+  if (new_priority < t->priority)
+    new_priority = t->priority;
+  // Moves T to its new run queue if it is ready
+  set_effective_priority(t, new_priority);
 
-  if (t->lock_waiting != NULL && depth != PRI_NESTING_MAX_DEPTH)
+  if (depth == PRI_NESTING_MAX_DEPTH)
+    return;
+  if (t->lock_waiting != NULL)
     thread_update_effective_priority_depth(t->lock_waiting->holder, depth + 1);
+  // A thread waiting for an rwlock donates to all of its holders
+  if (t->rwlock_waiting != NULL) {
+    struct list *holders = &t->rwlock_waiting->holders;
+    struct list_elem *e;
+    for (e = list_begin(holders); e != list_end(holders); e = list_next(e))
+      thread_update_effective_priority_depth(list_entry(e, struct rwlock_hold, elem)->thread,
+                                             depth + 1);
+  }
 }
 
 
@@ -155,10 +208,8 @@ void thread_update_effective_priority_no_yield(struct thread *t) {
 
 void thread_update_effective_priority(struct thread *t) {
   thread_update_effective_priority_no_yield(t);
-  int highest_ready_prio = list_entry(list_max(&ready_list, thread_prio_list_less, NULL), 
-                                      struct thread, elem)->effective_priority;
   //switch threads to new highest priority
-  if (threads_ready() > 0 &&  highest_ready_prio > thread_current()->effective_priority)
+  if (ready_queue_max_priority() > thread_current()->effective_priority)
   {
     if (intr_context ())
         intr_yield_on_return ();
@@ -200,11 +251,17 @@ get_thread_by_tid (tid_t tid)
 void
 thread_init (void) 
 {
+  int i;
+
   ASSERT (intr_get_level () == INTR_OFF);
 
   lock_init (&tid_lock);
-  list_init (&ready_list);
+  for (i = 0; i <= PRI_MAX; i++)
+    list_init (&ready_queues[i]);
+  ready_mask[0] = ready_mask[1] = 0;
+  ready_cnt = 0;
   list_init (&all_list);
+  list_init (&deferred_list);
 
   /* Set up a thread structure for the running thread. */
   initial_thread = running_thread ();
@@ -231,11 +288,11 @@ thread_start (void)
   sema_down (&idle_started);
 }
 
-/* Returns the number of threads currently in the ready list */
+/* Returns the number of threads currently in the run queues */
 size_t
 threads_ready (void)
 {
-  return list_size (&ready_list);      
+  return ready_cnt;
 }
 
 /* Called by the timer interrupt handler at each timer tick.
@@ -257,18 +314,17 @@ thread_tick (void)
 
   if (thread_mlfqs) {
     // Every tick increment recent_cpu of running thread by 1
-    if (thread_current () != idle_thread)
+    if (t != idle_thread)
       t->recent_cpu = FP_ADD_INT (t->recent_cpu, 1);
 
     // Every second update load_avg and then recent_cpu
-    if (timer_ticks() % TIMER_FREQ == 0) {
-      calculate_load_avg();
-      thread_foreach(&calculate_recent_cpu, NULL);
-    }
+    if (timer_ticks() % TIMER_FREQ == 0)
+      mlfqs_second();
 
-    // Recalculate thread priorities every 4 ticks (TIME_SLICE = 4)
-    if (timer_ticks () % TIME_SLICE == 0) 
-      thread_foreach (&calculate_thread_priority, NULL);
+    // Every 4 ticks (TIME_SLICE = 4) recalculate the running thread's
+    // priority.  Nobody else's recent_cpu changed since the last time
+    if (timer_ticks () % TIME_SLICE == 0 && t != idle_thread)
+      calculate_thread_priority (t, NULL);
   }
 
   /* Enforce preemption. */
@@ -282,6 +338,7 @@ thread_print_stats (void)
 {
   printf ("Thread: %lld idle ticks, %lld kernel ticks, %lld user ticks\n",
           idle_ticks, kernel_ticks, user_ticks);
+  printf ("Thread: %lld context switches\n", switch_cnt);
 }
 
 /* Creates a new kernel thread named NAME with the given initial
@@ -344,6 +401,8 @@ thread_create (const char *name, int priority,
   #ifdef USERPROG
   hash_init(&t->spt, hash_func, hash_less, NULL);
   list_init(&t->memory_mapped_files);
+  list_init(&t->frames);
+  list_init(&t->vmas);
   t->exit_status = malloc(sizeof(struct process_exit_status));
   process_exit_status_init(t->exit_status, t->tid);
 
@@ -373,7 +432,14 @@ thread_block (void)
   ASSERT (!intr_context ());
   ASSERT (intr_get_level () == INTR_OFF);
 
-  thread_current ()->status = THREAD_BLOCKED;
+  struct thread *cur = thread_current ();
+  if (thread_mlfqs && cur != idle_thread)
+    {
+      // Defer recent_cpu decay until the thread is unblocked
+      cur->recent_cpu_deferred = true;
+      list_push_back (&deferred_list, &cur->deferred_elem);
+    }
+  cur->status = THREAD_BLOCKED;
   schedule ();
 }
 
@@ -394,8 +460,15 @@ thread_unblock (struct thread *t)
 
   old_level = intr_disable ();
   ASSERT (t->status == THREAD_BLOCKED);
-  list_push_front(&ready_list, &t->elem);
+  if (t->recent_cpu_deferred)
+    {
+      list_remove (&t->deferred_elem);
+      t->recent_cpu_deferred = false;
+    }
+  if (thread_mlfqs)
+    mlfqs_catch_up (t);
   t->status = THREAD_READY;
+  ready_queue_push (t);
   intr_set_level (old_level);
 }
 
@@ -464,9 +537,9 @@ thread_yield (void)
   ASSERT (!intr_context ());
 
   old_level = intr_disable ();
-  if (cur != idle_thread) 
-    list_push_back(&ready_list, &cur->elem);
   cur->status = THREAD_READY;
+  if (cur != idle_thread) 
+    ready_queue_push (cur);
   schedule ();
   intr_set_level (old_level);
 }
@@ -519,14 +592,8 @@ thread_set_nice (int new_nice UNUSED)
   thread_current()->nice = new_nice;
   calculate_thread_priority(thread_current (), NULL);
 
-  if (!list_empty(&ready_list))
-  {
-    struct thread * next = list_entry (list_max (&ready_list,
-                                       &thread_prio_list_less, NULL),
-                                       struct thread, elem);
-    if(thread_current ()->effective_priority < next->effective_priority)
-      thread_yield ();
-  }
+  if (thread_current ()->effective_priority < ready_queue_max_priority ())
+    thread_yield ();
 
   /* TODO: 
   - Recalculate thread's priority based on the new value
@@ -568,12 +635,16 @@ void calculate_thread_priority(struct thread *t, void *aux UNUSED) {
                                       INTEGER_TO_FP(nice * 2));
   // Round down to the nearest zero - Truncation */
   int new_priority = FP_TO_INTEGER_ROUNDED_TO_ZERO(fp_priority);
-  t->effective_priority = new_priority;
+  if (new_priority < PRI_MIN)
+    new_priority = PRI_MIN;
+  else if (new_priority > PRI_MAX)
+    new_priority = PRI_MAX;
+  set_effective_priority(t, new_priority);
 }
 
 /* Formula: load_avg = (59/60)*load_avg + (1/60)*ready_threads */
 void calculate_load_avg() {
-  int ready_threads = list_size(&ready_list);
+  int ready_threads = ready_cnt;
   if (thread_current() != idle_thread) {
     ready_threads++;
   }
@@ -593,6 +664,79 @@ void calculate_recent_cpu(struct thread *t, void *aux UNUSED) {
   t->recent_cpu = FP_ADD_INT(FP_MULT_FP(coeff, t->recent_cpu), t->nice);
 }
 
+/* Brings blocked thread T's recent_cpu and priority up to date,
+   applying any decay deferred since T blocked.  Used by
+   sema_up() to compare the priorities of blocked waiters. */
+void thread_mlfqs_refresh(struct thread *t) {
+  enum intr_level old_level = intr_disable ();
+  mlfqs_catch_up (t);
+  if (t->recent_cpu_deferred) {
+    // Move to the back, keeping deferred_list ordered by epoch
+    list_remove (&t->deferred_elem);
+    list_push_back (&deferred_list, &t->deferred_elem);
+  }
+  intr_set_level (old_level);
+}
+
+/* Brings T's recent_cpu and priority up to date.  Interrupts
+   must be off. */
+static void mlfqs_catch_up(struct thread *t) {
+  if (t->recent_cpu_epoch != mlfqs_seconds) {
+    decay_recent_cpu (t);
+    calculate_thread_priority (t, NULL);
+  }
+}
+
+/* Applies the recent_cpu decays of every second since T's
+   recent_cpu_epoch, which must be no more than DECAY_HISTORY
+   seconds ago.  Interrupts must be off. */
+static void decay_recent_cpu(struct thread *t) {
+  ASSERT (mlfqs_seconds - t->recent_cpu_epoch <= DECAY_HISTORY);
+  for (; t->recent_cpu_epoch < mlfqs_seconds; t->recent_cpu_epoch++)
+    t->recent_cpu = FP_ADD_INT(FP_MULT_FP(decay_history[t->recent_cpu_epoch % DECAY_HISTORY],
+                                          t->recent_cpu), t->nice);
+}
+
+/* Once-a-second MLFQS update, in the timer interrupt.  Costs time
+   proportional to the number of ready threads, plus the few
+   blocked threads that have been deferred for DECAY_HISTORY
+   seconds, rather than to the number of threads. */
+static void mlfqs_second(void) {
+  int32_t two_load_avg;
+  int priority;
+
+  calculate_load_avg();
+  two_load_avg = FP_MULT_INT(load_avg, 2);
+  decay_history[mlfqs_seconds % DECAY_HISTORY] =
+    FP_DIV_FP(two_load_avg, FP_ADD_INT(two_load_avg, 1));
+  mlfqs_seconds++;
+
+  // Running thread
+  if (thread_current () != idle_thread)
+    mlfqs_catch_up (thread_current ());
+
+  // Ready threads.  A thread whose priority changes moves to another
+  // queue, possibly one not visited yet, where it is then skipped
+  // because it is already up to date
+  for (priority = PRI_MIN; priority <= PRI_MAX; priority++) {
+    struct list_elem *e = list_begin (&ready_queues[priority]);
+    while (e != list_end (&ready_queues[priority])) {
+      struct thread *t = list_entry (e, struct thread, elem);
+      e = list_next (e);
+      mlfqs_catch_up (t);
+    }
+  }
+
+  // Blocked threads about to run out of decay history
+  while (!list_empty (&deferred_list)) {
+    struct thread *t = list_entry (list_front (&deferred_list),
+                                   struct thread, deferred_elem);
+    if (mlfqs_seconds - t->recent_cpu_epoch < DECAY_HISTORY)
+      break;
+    thread_mlfqs_refresh (t);
+  }
+}
+
 
 /* Idle thread.  Executes when no other thread is ready to run.
 
@@ -616,6 +760,9 @@ idle (void *idle_started_ UNUSED)
       intr_disable ();
       thread_block ();
 
+      /* Stop the periodic tick if nothing needs it soon. */
+      timer_idle_enter ();
+
       /* Re-enable interrupts and wait for the next one.
 
          The `sti' instruction disables interrupts until the
@@ -683,13 +830,16 @@ init_thread (struct thread *t, const char *name, int priority)
   t->stack = (uint8_t *) t + PGSIZE;
   list_init(&t->donations);
   t->lock_waiting = NULL;
+  t->rwlock_waiting = NULL;
   t->priority = priority;
   t->magic = THREAD_MAGIC;
   
   
   #ifdef USERPROG
   list_init (&t->children_status);
-  list_init(&t->opened_files);
+  t->fds = NULL;
+  t->fd_cnt = 0;
+  t->fd_free = FD_MIN;
   sema_init(&t->sema_execute, 0);
   #endif
 
@@ -705,6 +855,7 @@ init_thread (struct thread *t, const char *name, int priority)
       t->nice = parent->nice;
       t->recent_cpu = parent->recent_cpu;
     } 
+    t->recent_cpu_epoch = mlfqs_seconds;
     calculate_thread_priority(t, NULL);
   }
   // Initially effective priority is the same as the given priority
@@ -737,12 +888,89 @@ alloc_frame (struct thread *t, size_t size)
 static struct thread *
 next_thread_to_run (void) 
 {
-  if (list_empty (&ready_list))
+  int priority = ready_queue_max_priority ();
+
+  if (priority < PRI_MIN)
     return idle_thread;
-  else {
-    struct list_elem *max_elem = list_remove_max (&ready_list, thread_prio_list_less);
-    return list_entry (max_elem, struct thread, elem);
-  }
+  else
+    {
+      struct thread *t = list_entry (list_front (&ready_queues[priority]),
+                                     struct thread, elem);
+      ready_queue_remove (t);
+      return t;
+    }
+}
+
+/* Appends ready thread T to the run queue for its effective
+   priority.  Interrupts must be off. */
+static void
+ready_queue_push (struct thread *t)
+{
+  int priority = t->effective_priority;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (t->status == THREAD_READY);
+  ASSERT (PRI_MIN <= priority && priority <= PRI_MAX);
+
+  list_push_back (&ready_queues[priority], &t->elem);
+  ready_mask[priority / 32] |= 1u << (priority % 32);
+  ready_cnt++;
+}
+
+/* Removes ready thread T from its run queue.  Interrupts must be
+   off. */
+static void
+ready_queue_remove (struct thread *t)
+{
+  int priority = t->effective_priority;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (t->status == THREAD_READY);
+
+  list_remove (&t->elem);
+  if (list_empty (&ready_queues[priority]))
+    ready_mask[priority / 32] &= ~(1u << (priority % 32));
+  ready_cnt--;
+}
+
+/* Returns the highest effective priority of any ready thread, or
+   PRI_MIN - 1 if no thread is ready. */
+static int
+ready_queue_max_priority (void)
+{
+  if (ready_mask[1] != 0)
+    return 32 + 31 - __builtin_clz (ready_mask[1]);
+  else if (ready_mask[0] != 0)
+    return 31 - __builtin_clz (ready_mask[0]);
+  else
+    return PRI_MIN - 1;
+}
+
+/* Sets T's effective priority to PRIORITY, moving T to the
+   matching run queue if it is ready, so that the run queues
+   always reflect donation and MLFQS priority changes.  The idle
+   thread is never in a run queue, even when it is ready after
+   yielding. */
+static void
+set_effective_priority (struct thread *t, int priority)
+{
+  enum intr_level old_level;
+
+  ASSERT (PRI_MIN <= priority && priority <= PRI_MAX);
+
+  old_level = intr_disable ();
+  if (t->effective_priority != priority)
+    {
+      if (t->status == THREAD_READY && t != idle_thread)
+        {
+          ready_queue_remove (t);
+          t->effective_priority = priority;
+          ready_queue_push (t);
+        }
+      else
+        t->effective_priority = priority;
+    }
+  intr_set_level (old_level);
 }
 
 /* Completes a thread switch by activating the new thread's page
@@ -810,7 +1038,10 @@ schedule (void)
   ASSERT (is_thread (next));
 
   if (cur != next)
-    prev = switch_threads (cur, next);
+    {
+      switch_cnt++;
+      prev = switch_threads (cur, next);
+    }
   thread_schedule_tail (prev);
 }
 
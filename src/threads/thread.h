@@ -102,12 +102,17 @@ struct thread
     struct list_elem allelem;           /* List element for all threads list. */
     struct list donations;              /* List of donating threads*/
     struct lock *lock_waiting;          /* Lock that thread is waiting on*/
+    struct rwlock *rwlock_waiting;      /* Rwlock that thread is waiting on*/
+    struct rwlock_hold rwlock_holds[RWLOCK_HOLD_MAX]; /* Rwlocks held*/
     /* Shared between thread.c and synch.c. */
     struct list_elem elem;              /* List element. */
     /* BSD Values*/ 
     int nice;                           /* Niceness of a thread*/
     int32_t recent_cpu;                 /* Estimate of CPU time the thread has
                                            used recently. (In FP)*/
+    int64_t recent_cpu_epoch;           /* Seconds of decay applied to recent_cpu*/
+    bool recent_cpu_deferred;           /* In deferred_list (thread.c)? */
+    struct list_elem deferred_elem;     /* List element for deferred_list*/
 
 #ifdef USERPROG
     struct list children_status;
@@ -117,8 +122,12 @@ struct thread
     uint32_t *pagedir;                  /* Page directory. */
     struct semaphore sema_execute;      /* Synchronization in process_execute */
     struct file* exec_file;             /* Process is using this executable file */
-    struct list opened_files;           /* A list of files opened by the thread*/
+    struct file **fds;                  /* Open files indexed by fd (userprog/fd.c)*/
+    int fd_cnt;                         /* Number of entries in fds*/
+    int fd_free;                        /* Lowest fd that may be free*/
     struct list memory_mapped_files;    /* List of Memory Mapped Files*/
+    struct list frames;                 /* Mappings of frames holding this process's pages*/
+    struct list vmas;                   /* Virtual memory areas, sorted by address*/
 #endif
     /* Owned by thread.c. */
     unsigned magic;                     /* Detects stack overflow. */
@@ -131,12 +140,6 @@ struct thread_elem {
    struct thread *thread; /* pointer to the thread that is being stored in the list*/
 };
 
-struct file_wrapper {
-    struct file *file;
-    struct list_elem file_elem;
-    int fd;
-};
-
 /* If false (default), use round-robin scheduler.
    If true, use multi-level feedback queue scheduler.
    Controlled by kernel command-line option "mlfqs". */
@@ -170,6 +173,7 @@ void thread_foreach (thread_action_func *, void *);
 void calculate_thread_priority(struct thread *t, void *aux UNUSED);
 void calculate_load_avg(void);
 void calculate_recent_cpu(struct thread *t, void *aux UNUSED);
+void thread_mlfqs_refresh(struct thread *t);
 
 int thread_get_priority (void);
 void thread_set_priority (int);
@@ -13,14 +13,18 @@
 #include "threads/palloc.h"
 #include "userprog/syscall.h"
 #include "vm/mmap.h"
+#include "vm/vma.h"
 
 /* Number of page faults processed. */
 static long long page_fault_cnt;
 
+/* Number of pages mapped by fault-around. */
+static long long fault_around_cnt;
+
 static void kill (struct intr_frame *);
 static void page_fault (struct intr_frame *);
 bool is_stack_access (void *esp, void *addr);
-static bool grow_stack(void *fault_addr);
+static bool grow_stack(void *fault_addr, bool write);
 
 #define PUSHA_BYTES 32
 #define PUSH_BYTES 4
@@ -76,6 +80,7 @@ void
 exception_print_stats (void) 
 {
   printf ("Exception: %lld page faults\n", page_fault_cnt);
+  printf ("Exception: %lld pages mapped by fault-around\n", fault_around_cnt);
 }
 
 /* Handler for an exception (probably) caused by a user process. */
@@ -166,14 +171,25 @@ page_fault (struct intr_frame *f) {
    if (fpage != NULL && write && !fpage->writable) {
       exit(-1);
       /* If page is found and the address is a valid virtual user address then load it*/
+   }
+   /* Writing to a present writable page mapped read only: the page is
+      shared copy-on-write with a forked process */
+   if (fpage != NULL && write && !not_present) {
+      if (!spt_cow_fault(fpage))
+         exit(-1);
+      return;
    }
     if (fpage != NULL && is_user_vaddr(fault_addr)) {
-      load_page_from_spt(fpage);
+      /* Reading a demand-zero page maps the shared zero page */
+      if (!write && spt_map_zero_page(fpage))
+         return;
+      if (load_page_from_spt(fpage))
+         fault_around_cnt += spt_fault_around(fpage);
       return;
    /* If the page fault occured when setting up the stack then grow the stack*/
    }
    if (is_stack_access(f->esp, fault_addr)) {
-      if (!grow_stack(fault_addr)) {
+      if (!grow_stack(fault_addr, write)) {
          exit(-1);
       }
    } else if (user || not_present) {
@@ -182,11 +198,15 @@ page_fault (struct intr_frame *f) {
 
 }
 
-static bool grow_stack(void *fault_addr) {
-   struct spt_entry *new_stack_page = create_zero_page(pg_round_down(fault_addr), true);
-   spt_add_page(&thread_current()->spt, new_stack_page);
-   load_page_from_spt(new_stack_page);
-   return true;
+static bool grow_stack(void *fault_addr, bool write) {
+   if (!vma_grow_stack(fault_addr))
+      return false;
+   struct spt_entry *new_stack_page = spt_find_addr(fault_addr);
+   if (new_stack_page == NULL)
+      return false;
+   if (!write && spt_map_zero_page(new_stack_page))
+      return true;
+   return load_page_from_spt(new_stack_page);
 }
 
 bool
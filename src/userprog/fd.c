@@ -0,0 +1,140 @@
+#include "userprog/fd.h"
+#include <string.h>
+#include "filesys/file.h"
+#include "threads/malloc.h"
+#include "threads/thread.h"
+
+/* Each process's open files live in an array indexed by file
+   descriptor, t->fds, with a null pointer for a free descriptor.
+   The array starts small and doubles as needed, up to fd_limit
+   entries.  t->fd_free is the lowest descriptor that may be
+   free: all those below it are in use. */
+
+/* Initial size of a process's descriptor array. */
+#define FD_INITIAL_CNT 16
+
+int fd_limit = FD_LIMIT_DEFAULT;
+
+static bool grow_fds (struct thread *, int cnt);
+
+/* Adds FILE to the current process's open files under the lowest
+   free file descriptor, and returns it.  Returns -1 if the
+   process has reached fd_limit or if memory allocation fails. */
+int
+fd_install (struct file *file)
+{
+  struct thread *t = thread_current ();
+  int fd;
+
+  for (fd = t->fd_free; fd < t->fd_cnt; fd++)
+    if (t->fds[fd] == NULL)
+      break;
+  if (fd >= t->fd_cnt && !grow_fds (t, fd + 1))
+    return -1;
+
+  t->fds[fd] = file;
+  t->fd_free = fd + 1;
+  return fd;
+}
+
+/* Returns the current process's file open as FD, or a null
+   pointer if FD isn't open. */
+struct file *
+fd_lookup (int fd)
+{
+  struct thread *t = thread_current ();
+
+  if (fd < FD_MIN || fd >= t->fd_cnt)
+    return NULL;
+  return t->fds[fd];
+}
+
+/* Frees file descriptor FD of the current process and returns
+   the file that was open as FD, without closing it.  Returns a
+   null pointer if FD isn't open. */
+struct file *
+fd_remove (int fd)
+{
+  struct thread *t = thread_current ();
+  struct file *file = fd_lookup (fd);
+
+  if (file != NULL)
+    {
+      t->fds[fd] = NULL;
+      if (fd < t->fd_free)
+        t->fd_free = fd;
+    }
+  return file;
+}
+
+/* Closes all of the current process's open files and frees its
+   descriptor array. */
+void
+fd_close_all (void)
+{
+  struct thread *t = thread_current ();
+  int fd;
+
+  for (fd = FD_MIN; fd < t->fd_cnt; fd++)
+    if (t->fds[fd] != NULL)
+      file_close (t->fds[fd]);
+  free (t->fds);
+  t->fds = NULL;
+  t->fd_cnt = 0;
+  t->fd_free = FD_MIN;
+}
+
+/* Gives the current process, which has no open files yet, its
+   own handle to each of PARENT's open files, at the same file
+   descriptor and file position.  Returns false if memory
+   allocation fails, leaving the handles copied so far open. */
+bool
+fd_duplicate (struct thread *parent)
+{
+  struct thread *t = thread_current ();
+  int fd;
+
+  ASSERT (t->fd_cnt == 0);
+
+  if (parent->fd_cnt == 0)
+    return true;
+  if (!grow_fds (t, parent->fd_cnt))
+    return false;
+  for (fd = FD_MIN; fd < parent->fd_cnt; fd++)
+    if (parent->fds[fd] != NULL)
+      {
+        struct file *file = file_reopen (parent->fds[fd]);
+        if (file == NULL)
+          return false;
+        file_seek (file, file_tell (parent->fds[fd]));
+        t->fds[fd] = file;
+      }
+  t->fd_free = parent->fd_free;
+  return true;
+}
+
+/* Grows T's descriptor array to hold at least CNT descriptors.
+   Returns false if CNT exceeds fd_limit or if memory allocation
+   fails. */
+static bool
+grow_fds (struct thread *t, int cnt)
+{
+  struct file **fds;
+  int new_cnt;
+
+  if (cnt > fd_limit)
+    return false;
+  new_cnt = t->fd_cnt > 0 ? t->fd_cnt : FD_INITIAL_CNT;
+  while (new_cnt < cnt)
+    new_cnt *= 2;
+  if (new_cnt > fd_limit)
+    new_cnt = fd_limit;
+
+  fds = realloc (t->fds, new_cnt * sizeof *fds);
+  if (fds == NULL)
+    return false;
+  memset (fds + t->fd_cnt, 0, (new_cnt - t->fd_cnt) * sizeof *fds);
+  t->fds = fds;
+  t->fd_cnt = new_cnt;
+  return true;
+}
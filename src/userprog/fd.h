@@ -0,0 +1,26 @@
+#ifndef USERPROG_FD_H
+#define USERPROG_FD_H
+
+#include <stdbool.h>
+
+struct file;
+struct thread;
+
+/* Lowest file descriptor handed out for files.  0 and 1 are the
+   console. */
+#define FD_MIN 2
+
+/* Default per-process limit on file descriptors. */
+#define FD_LIMIT_DEFAULT 1024
+
+/* File descriptors a process may use are below this limit.
+   Controlled by kernel command-line option "-fdlimit". */
+extern int fd_limit;
+
+int fd_install (struct file *);
+struct file *fd_lookup (int fd);
+struct file *fd_remove (int fd);
+void fd_close_all (void);
+bool fd_duplicate (struct thread *parent);
+
+#endif /* userprog/fd.h */
@@ -1,14 +1,25 @@
 #include "userprog/pagedir.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
 #include "threads/pte.h"
 #include "threads/palloc.h"
 #include "vm/frame.h"
 
+/* Largest number of pages pagedir_clear_range() invalidates one by
+   one.  Beyond that, flushing the whole TLB is cheaper. */
+#define INVLPG_MAX_PAGES 32
+
+/* Address space switch statistics. */
+static long long load_cnt;      /* Page directories loaded into CR3. */
+static long long skip_cnt;      /* Activations of the loaded directory. */
+
 static uint32_t *active_pd (void);
+static void load_pagedir (uint32_t *);
 static void invalidate_pagedir (uint32_t *);
+static void invalidate_page (uint32_t *, const void *);
 
 /* Creates a new page directory that has mappings for kernel
    virtual addresses, but none for user virtual addresses.
@@ -24,7 +35,8 @@ pagedir_create (void)
 }
 
 /* Destroys page directory PD, freeing all the pages it
-   references. */
+   references.  Pages held in the frame table should already have
+   been released with free_process_frames(). */
 void
 pagedir_destroy (uint32_t *pd) 
 {
@@ -42,13 +54,10 @@ pagedir_destroy (uint32_t *pd)
         
         for (pte = pt; pte < pt + PGSIZE / sizeof *pte; pte++)
           if (*pte & PTE_P) 
-            //palloc_free_page (pte_get_page (*pte));
-            free_frame_from_table(pte_get_page(*pte));
-        //palloc_free_page (pt);
-        free_frame_from_table(pt);
+            palloc_free_page (pte_get_page (*pte));
+        palloc_free_page (pt);
       }
-  //palloc_free_page (pd);
-  free_frame_from_table(pd);
+  palloc_free_page (pd);
 }
 
 /* Returns the address of the page table entry for virtual
@@ -156,10 +165,40 @@ pagedir_clear_page (uint32_t *pd, void *upage)
   if (pte != NULL && (*pte & PTE_P) != 0)
     {
       *pte &= ~PTE_P;
-      invalidate_pagedir (pd);
+      invalidate_page (pd, upage);
     }
 }
 
+/* Marks the PAGE_CNT user virtual pages starting at UPAGE "not
+   present" in page directory PD, like pagedir_clear_page(), but
+   invalidates the TLB once for the whole range: page by page if
+   only a few pages were mapped, otherwise by flushing the TLB.
+   The pages need not be mapped. */
+void
+pagedir_clear_range (uint32_t *pd, void *upage, size_t page_cnt)
+{
+  bool active = active_pd () == pd;
+  uint8_t *page = upage;
+  size_t cleared = 0;
+  size_t i;
+
+  ASSERT (pg_ofs (upage) == 0);
+  ASSERT (page_cnt <= pg_no (PHYS_BASE) - pg_no (upage));
+
+  for (i = 0; i < page_cnt; i++, page += PGSIZE)
+    {
+      uint32_t *pte = lookup_page (pd, page, false);
+      if (pte != NULL && (*pte & PTE_P) != 0)
+        {
+          *pte &= ~PTE_P;
+          if (active && ++cleared <= INVLPG_MAX_PAGES)
+            invalidate_page (pd, page);
+        }
+    }
+  if (cleared > INVLPG_MAX_PAGES)
+    invalidate_pagedir (pd);
+}
+
 /* Returns true if the PTE for virtual page VPAGE in PD is dirty,
    that is, if the page has been modified since the PTE was
    installed.
@@ -184,7 +223,7 @@ pagedir_set_dirty (uint32_t *pd, const void *vpage, bool dirty)
       else 
         {
           *pte &= ~(uint32_t) PTE_D;
-          invalidate_pagedir (pd);
+          invalidate_page (pd, vpage);
         }
     }
 }
@@ -213,7 +252,7 @@ pagedir_set_accessed (uint32_t *pd, const void *vpage, bool accessed)
       else 
         {
           *pte &= ~(uint32_t) PTE_A; 
-          invalidate_pagedir (pd);
+          invalidate_page (pd, vpage);
         }
     }
 }
@@ -240,25 +279,35 @@ pagedir_set_writable (uint32_t *pd, const void *vpage, bool writable)
       else 
         {
           *pte &= ~(uint32_t) PTE_W;
-          invalidate_pagedir (pd);
+          invalidate_page (pd, vpage);
         }
     }
 }
 
 /* Loads page directory PD into the CPU's page directory base
-   register. */
+   register, unless it is already loaded: reloading it would only
+   flush the TLB.  Use invalidate_pagedir() for that. */
 void
 pagedir_activate (uint32_t *pd) 
 {
   if (pd == NULL)
     pd = init_page_dir;
 
-  /* Store the physical address of the page directory into CR3
-     aka PDBR (page directory base register).  This activates our
-     new page tables immediately.  See [IA32-v2a] "MOV--Move
-     to/from Control Registers" and [IA32-v3a] 3.7.5 "Base
-     Address of the Page Directory". */
-  asm volatile ("movl %0, %%cr3" : : "r" (vtop (pd)) : "memory");
+  if (active_pd () == pd)
+    {
+      skip_cnt++;
+      return;
+    }
+  load_cnt++;
+  load_pagedir (pd);
+}
+
+/* Prints address space switch statistics. */
+void
+pagedir_print_stats (void)
+{
+  printf ("Paging: %lld page directory loads, %lld avoided\n",
+          load_cnt, skip_cnt);
 }
 
 /* Returns the currently active page directory. */
@@ -274,6 +323,17 @@ active_pd (void)
   return ptov (pd);
 }
 
+/* Stores the physical address of page directory PD into CR3 aka
+   PDBR (page directory base register).  This activates its page
+   tables immediately and flushes all but global entries from the
+   TLB.  See [IA32-v2a] "MOV--Move to/from Control Registers" and
+   [IA32-v3a] 3.7.5 "Base Address of the Page Directory". */
+static void
+load_pagedir (uint32_t *pd)
+{
+  asm volatile ("movl %0, %%cr3" : : "r" (vtop (pd)) : "memory");
+}
+
 /* Some page table changes can cause the CPU's translation
    lookaside buffer (TLB) to become out-of-sync with the page
    table.  When this happens, we have to "invalidate" the TLB by
@@ -287,8 +347,18 @@ invalidate_pagedir (uint32_t *pd)
 {
   if (active_pd () == pd) 
     {
-      /* Re-activating PD clears the TLB.  See [IA32-v3a] 3.12
+      /* Re-loading PD clears the TLB.  See [IA32-v3a] 3.12
          "Translation Lookaside Buffers (TLBs)". */
-      pagedir_activate (pd);
+      load_pagedir (pd);
     } 
 }
+
+/* Invalidates the TLB entry for virtual page VPAGE if PD is the
+   active page directory, leaving the rest of the TLB alone.  See
+   [IA32-v2a] "INVLPG--Invalidate TLB Entry". */
+static void
+invalidate_page (uint32_t *pd, const void *vpage)
+{
+  if (active_pd () == pd)
+    asm volatile ("invlpg (%0)" : : "r" (vpage) : "memory");
+}
@@ -20,9 +20,12 @@
 #include "threads/palloc.h"
 #include "threads/malloc.h"
 #include "vm/frame.h"
+#include "vm/vma.h"
 #include "userprog/syscall.h"
+#include "userprog/fd.h"
 
 static thread_func start_process NO_RETURN;
+static thread_func start_fork NO_RETURN;
 static bool load (const char *cmdline, void (**eip) (void), void **esp);
 
 /* Our defined helper functions*/
@@ -35,7 +38,6 @@ static bool push_arg_pointers(struct intr_frame *if_,int argc, void **ptr_arr);
 static bool push_argc(struct intr_frame *if_, int argc);
 static bool push_null_sentinel(struct intr_frame *if_);
 static int tokenise(char **argv, int argc, char *file_name);
-static void close_all_files(void);
 static void free_children(void);
 static void dec_ref_count(struct process_exit_status *exit_status);
 
@@ -133,9 +135,6 @@ start_process (void *file_name_)
   if(success)
   {
     setup_user_stack(argv, argc, &if_);
-    struct file *file = filesys_open(file_name);
-    curr->exec_file = file;
-    file_deny_write(file);
     // Free up memory
     palloc_free_page(argv);
     curr->exit_status->loaded = true;
@@ -163,6 +162,82 @@ start_process (void *file_name_)
   NOT_REACHED ();
 }
 
+/* Passed from process_fork() to the child's start_fork() */
+struct fork_args {
+  struct thread *parent;      /* Forking process, blocked until done is upped */
+  struct intr_frame if_;      /* Parent's user registers at the fork */
+  bool success;               /* Whether the child was set up */
+  struct semaphore done;      /* Upped by the child once set up or failed */
+};
+
+/* Creates a child of the current process running a copy of it, from
+   the point of the system call described by IF_. The child's address
+   space is shared with the parent copy-on-write, and it gets its own
+   handles to the parent's open files, at the same fds and offsets.
+   Memory-mapped files aren't inherited. Returns the child's thread id
+   to the parent, or TID_ERROR if it couldn't be created; the child
+   sees 0. */
+tid_t
+process_fork (struct intr_frame *if_)
+{
+  struct fork_args args;
+  tid_t tid;
+
+  args.parent = thread_current ();
+  args.if_ = *if_;
+  args.success = false;
+  sema_init (&args.done, 0);
+
+  tid = thread_create (thread_name (), PRI_DEFAULT, start_fork, &args);
+  if (tid == TID_ERROR)
+    return TID_ERROR;
+  sema_down (&args.done);
+  return args.success ? tid : TID_ERROR;
+}
+
+/* A thread function that copies the process that forked it and
+   returns to user mode in the copy */
+static void
+start_fork (void *args_)
+{
+  struct fork_args *args = args_;
+  struct thread *parent = args->parent;
+  struct thread *cur = thread_current ();
+  struct intr_frame if_ = args->if_;
+  bool success = false;
+
+  cur->pagedir = pagedir_create ();
+  if (cur->pagedir == NULL)
+    goto done;
+  process_activate ();
+
+  cur->exec_file = file_reopen (parent->exec_file);
+  if (cur->exec_file != NULL)
+    file_deny_write (cur->exec_file);
+  success = cur->exec_file != NULL && fd_duplicate (parent);
+
+  /* The parent is blocked on args->done, so its address space is
+     stable while it's copied */
+  success = success && spt_fork (parent);
+
+ done:
+  /* ARGS lives on the parent's stack: it mustn't be touched once the
+     parent has been woken */
+  cur->exit_status->loaded = success;
+  args->success = success;
+  sema_up (&args->done);
+  if (!success)
+    {
+      cur->exit_status->exit_code = -1;
+      thread_exit ();
+    }
+
+  /* Return to user mode as the parent did, but seeing 0 from fork */
+  if_.eax = 0;
+  asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (&if_) : "memory");
+  NOT_REACHED ();
+}
+
 /* Waits for thread TID to die and returns its exit status. 
  * If it was terminated by the kernel (i.e. killed due to an exception), 
  * returns -1.  
@@ -197,7 +272,15 @@ process_wait (tid_t child_tid UNUSED)
 }
 
 static void free_spt_entry(struct hash_elem *e, void *aux UNUSED) {
-  free(hash_entry(e, struct spt_entry, hash_elem));
+  struct spt_entry *entry = hash_entry(e, struct spt_entry, hash_elem);
+  uint32_t *pd = thread_current()->pagedir;
+  /* The zero page is shared by every process: unmap it so that it
+     isn't freed with the page directory */
+  if (pagedir_get_page(pd, entry->upage) == frame_zero_page())
+    pagedir_clear_page(pd, entry->upage);
+  if (entry->has_swap_copy)
+    swap_drop(entry->swap_index);
+  free(entry);
 }
 
 /* Free the current process's resources. */
@@ -217,11 +300,22 @@ process_exit (void)
     munmap(list_entry(e, struct memory_file, elem)->mapid);
   }
   // Closes all opened files
-  close_all_files();
+  fd_close_all();
   // Remove children and free the memory
   free_children();
+  // Unmap every area at once, invalidating the TLB once per area
+  // rather than once per page
+  if (cur->pagedir != NULL) {
+    for (e = list_begin(&cur->vmas); e != list_end(&cur->vmas); e = list_next(e)) {
+      struct vma *vma = list_entry(e, struct vma, elem);
+      pagedir_clear_range(cur->pagedir, vma->start, pg_no(vma->end) - pg_no(vma->start));
+    }
+  }
+  // Free this process's frames while their SPT entries are still valid
+  free_process_frames(cur);
 
   hash_clear(&cur->spt, free_spt_entry);
+  vma_destroy_all();
 
 
   /* Destroy the current process's page directory and switch back
@@ -242,7 +336,7 @@ process_exit (void)
     }
   // Tests multi-oom - tp stop kernel panick do NULL check
   if (cur->exec_file != NULL) {
-    file_allow_write(cur->exec_file);
+    file_close(cur->exec_file);
   }
   printf ("%s: exit(%d)\n", cur->name, cur->exit_status->exit_code);
   sema_up(&cur->exit_status->sema);
@@ -257,8 +351,14 @@ process_activate (void)
 {
   struct thread *t = thread_current ();
 
-  /* Activate thread's page tables. */
-  pagedir_activate (t->pagedir);
+  /* Activate thread's page tables.  A kernel thread has none and
+     never touches user memory, so it keeps running in the address
+     space it was switched from rather than loading the kernel-only
+     page directory.  That address space can't be destroyed under
+     it: process_exit() switches away from a page directory before
+     destroying it. */
+  if (t->pagedir != NULL)
+    pagedir_activate (t->pagedir);
 
   /* Set thread's kernel stack for use in processing
      interrupts. */
@@ -444,15 +544,22 @@ load (const char *file_name, void (**eip) (void), void **esp)
   success = true;
 
  done:
-  /* We arrive here whether the load is successful or not. */
-  file_close (file);
+  /* We arrive here whether the load is successful or not.  On
+     success the executable stays open, and unwritable, for as long
+     as the process runs: its pages are loaded from it lazily and
+     shared with other processes by its inode. */
+  if (success)
+    {
+      t->exec_file = file;
+      file_deny_write (file);
+    }
+  else
+    file_close (file);
   return success;
 }
 
 /* load() helpers. */
 
-static bool install_page (void *upage, void *kpage, bool writable);
-
 /* Checks whether PHDR describes a valid, loadable segment in
    FILE and returns true if so, false otherwise. */
 static bool
@@ -520,23 +627,20 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
   ASSERT (pg_ofs (upage) == 0);
   ASSERT (ofs % PGSIZE == 0);
 
-  file_seek(file, ofs);
-  while (read_bytes > 0 || zero_bytes > 0) 
+  /* A first page shared with the previous segment keeps its own SPT
+     entry, covering both segments. */
+  if (vma_find (upage) != NULL)
     {
-
       size_t page_read_bytes = read_bytes < PGSIZE ? read_bytes : PGSIZE;
       size_t page_zero_bytes = PGSIZE - page_read_bytes;
-      struct thread *t = thread_current();
-      struct spt_entry *pagedata = create_file_page(file, upage, ofs, read_bytes, zero_bytes, writable, false);
+      struct spt_entry *overlap = spt_find_addr (upage);
 
-      if (pagedata == NULL)
+      if (overlap == NULL)
         return false;
-
-      struct spt_entry *overlap = spt_add_page(&t->spt, pagedata);
-      if (overlap != NULL)  {
-        overlap->writable = overlap->writable || writable;
-        overlap->read_bytes += read_bytes;
-      }
+      overlap->writable = overlap->writable || writable;
+      if (overlap->read_bytes < page_read_bytes)
+        overlap->read_bytes = page_read_bytes;
+      overlap->zero_bytes = PGSIZE - overlap->read_bytes;
 
       /* Advance. */
       ofs += PGSIZE;
@@ -544,53 +648,36 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
       zero_bytes -= page_zero_bytes;
       upage += PGSIZE;
     }
-  return true;
+
+  /* The rest of the segment is one area, faulted in page by page. */
+  if (read_bytes + zero_bytes == 0)
+    return true;
+  return vma_add (upage, read_bytes + zero_bytes, file, ofs, read_bytes,
+                  writable, false) != NULL;
 }
 
 
 
 /* Create a minimal stack by mapping a zeroed page at the top of
-   user virtual memory. */
+   user virtual memory.  The page goes through the frame table like
+   any other user page, so it can be evicted and is released along
+   with the rest of the process's frames. */
 static bool
 setup_stack (void **esp) 
 {
-  uint8_t *kpage;
-  bool success = false;
+  struct spt_entry *stack_page;
 
-  kpage = palloc_get_page (PAL_USER | PAL_ZERO);
-  if (kpage != NULL) 
-    {
-      success = install_page (((uint8_t *) PHYS_BASE) - PGSIZE, kpage, true);
-      if (success)
-        *esp = PHYS_BASE;
-      else
-        //palloc_free_page (kpage);
-        free_frame_from_table(kpage);
-    }
-  return success;
+  if (vma_add (((uint8_t *) PHYS_BASE) - PGSIZE, PGSIZE, NULL, 0, 0,
+               true, false) == NULL)
+    return false;
+  stack_page = spt_find_addr (((uint8_t *) PHYS_BASE) - PGSIZE);
+  if (stack_page == NULL || !load_page_from_spt (stack_page))
+    return false;
+  *esp = PHYS_BASE;
+  return true;
 }
 
 
-/* Adds a mapping from user virtual address UPAGE to kernel
-   virtual address KPAGE to the page table.
-   If WRITABLE is true, the user process may modify the page;
-   otherwise, it is read-only.
-   UPAGE must not already be mapped.
-   KPAGE should probably be a page obtained from the user pool
-   with palloc_get_page().
-   Returns true on success, false if UPAGE is already mapped or
-   if memory allocation fails. */
-static bool
-install_page (void *upage, void *kpage, bool writable)
-{
-  struct thread *t = thread_current ();
-
-  /* Verify that there's not already a page at that virtual
-     address, then map our page there. */
-  return (pagedir_get_page (t->pagedir, upage) == NULL
-          && pagedir_set_page (t->pagedir, upage, kpage, writable));
-}
-
 /* Helper Functions*/
 
 
@@ -699,16 +786,6 @@ process_exit_status *get_process_exit_status_from_tid(tid_t tid) {
 
 /* Process_exit and process_wait and process_execute helpers*/
  
-static void close_all_files() {
-  // Close all opened files
-  struct list_elem *elem;
-  while (!list_empty(&thread_current()->opened_files)) {
-    elem = list_pop_front(&thread_current()->opened_files);
-    file_close(list_entry(elem, struct file_wrapper, file_elem)->file);
-    free(list_entry(elem, struct file_wrapper, file_elem));
-  }
-}
-
 // decrements exit_status->ref_count and frees exit_status if ref_count is 0
 static void dec_ref_count(struct process_exit_status *exit_status) {
   lock_acquire(&exit_status->lock);
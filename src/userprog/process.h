@@ -3,6 +3,7 @@
 
 #include "threads/thread.h"
 #include "threads/synch.h"
+#include "threads/interrupt.h"
 
 //Stores the status of a process, and synchronization structures to ensure thread safe access
 struct process_exit_status {
@@ -18,6 +19,7 @@ struct process_exit_status {
 };
 
 tid_t process_execute (const char *file_name);
+tid_t process_fork (struct intr_frame *);
 int process_wait (tid_t);
 void process_exit (void);
 void process_activate (void);
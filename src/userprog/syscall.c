@@ -4,6 +4,7 @@
 #include <string.h>
 #include "lib/kernel/stdio.h"
 #include "userprog/syscall.h"
+#include "userprog/fd.h"
 #include <syscall-nr.h>
 #include "threads/interrupt.h"
 #include "threads/thread.h"
@@ -20,6 +21,7 @@
 #include "vm/mmap.h"
 #include "vm/page.h"
 #include "vm/frame.h"
+#include "vm/vma.h"
 
 
 #define MAX_SYSCALLS 21
@@ -45,17 +47,12 @@ static void close (int fd);
 static mapid_t mmap(int fd, void* addr);
 
 
-static int get_next_fd(void);
-struct file_wrapper *get_file_by_fd (int fd);
-
-static struct lock lock_filesys;
 static mapid_t get_next_mapid(void);
 
 void
 syscall_init (void) 
 {
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
-  lock_init(&lock_filesys);
   syscall_handlers[SYS_HALT] = &halt;
   syscall_handlers[SYS_EXIT] = &exit;
   syscall_handlers[SYS_EXEC] = &exec;
@@ -86,6 +83,13 @@ syscall_handler (struct intr_frame *f )
   if (system_call_number < SYS_HALT || system_call_number > MAX_SYSCALLS)
     exit (-1);
 
+  // fork duplicates the caller's user registers, so it takes the whole
+  // interrupt frame rather than arguments
+  if (system_call_number == SYS_FORK) {
+    f->eax = process_fork(f);
+    return;
+  }
+
   // Generic Function wrapper
   int (*function) (int, int, int) = syscall_handlers[system_call_number];
   // Max 3 arguments, if an argument is not valid then it just passes null
@@ -109,10 +113,6 @@ static void halt(void) {
 
 void exit(int status) {
   struct thread *cur = thread_current();
-  // Release lock, if held by thread about to exit
-  if (lock_held_by_current_thread(&lock_filesys)) {
-    lock_release(&lock_filesys);
-  }
   // Free mmap files in process exit or here
   cur->exit_status->exit_code = status;
   
@@ -124,9 +124,7 @@ static pid_t exec (const char *file) {
   if (!is_vaddr(file)) {
     return pid;
   }
-  filesys_lock_acquire();
   pid = process_execute(file);
-  filesys_lock_release();
   return pid;
 }
 
@@ -141,9 +139,7 @@ static bool create (const char *file, unsigned initial_size) {
   // Currently passess all tests for create but needs to be checked
   //all checks complete. create file
   // printf("create\n");
-  filesys_lock_acquire();
   bool success = filesys_create(file, initial_size);
-  filesys_lock_release();
   return success;
 }
 
@@ -159,56 +155,43 @@ static int open (const char *file) {
     return -1;
   }
   struct file *opened_file;
-  struct file_wrapper *wrapped_file;
+  int fd;
   if (!is_vaddr((struct inode *) file)) {
     return -1;
   }
-  filesys_lock_acquire();
   opened_file = filesys_open(file);
-  filesys_lock_release();
 
   if (opened_file == NULL) {
     return -1;
   }
-  // Is freed in exit()
-  wrapped_file = malloc (sizeof(struct file_wrapper));
-  if (wrapped_file == NULL) {
-    return -1;
+  // Is closed in close() or exit()
+  fd = fd_install(opened_file);
+  if (fd == -1) {
+    file_close(opened_file);
   }
-  filesys_lock_acquire();
-  wrapped_file->file = opened_file;
-  wrapped_file->fd = get_next_fd();
-  list_push_back(&thread_current()->opened_files, &wrapped_file->file_elem);
-  filesys_lock_release();
-
-  return wrapped_file->fd;  
+  return fd;
 }
 
 
 static bool remove (const char *file) {
   // check if filename is empty, in which case can't remove
-  filesys_lock_acquire();
   struct file *f = filesys_open(file);
   if (f == NULL) {
-    filesys_lock_release();
     exit(-1);
   } else {
     file_close(f);
   }
   bool deleted_file = filesys_remove(file);
-  filesys_lock_release();
   return deleted_file;
 }
 
 
 static int filesize (int fd ) {
-  struct file_wrapper *fw = get_file_by_fd(fd);
-  if (fw == NULL) {
+  struct file *f = fd_lookup(fd);
+  if (f == NULL) {
     return -1;
   }
-  filesys_lock_acquire();
-  int size = file_length(fw->file);
-  filesys_lock_release();
+  int size = file_length(f);
   return size;
 }
 
@@ -229,56 +212,44 @@ static int read (int fd, void *buffer, unsigned length) {
     return length;
     }
   } else {
-    filesys_lock_acquire();
-    struct file_wrapper *f = get_file_by_fd(fd);
-    filesys_lock_release();
+    struct file *f = fd_lookup(fd);
     if (f == NULL) {
       return -1;
     }
-    filesys_lock_acquire();
-    length_read = file_read(f->file, buffer, length);
-    filesys_lock_release();
+    length_read = file_read(f, buffer, length);
 
   }
   return length_read;
 }
 
 static void seek (int fd , unsigned position ) {
-  struct file_wrapper *file;
-  file = get_file_by_fd(fd);
+  struct file *file;
+  file = fd_lookup(fd);
   if (file == NULL) {
     exit(-1);
   }
-  filesys_lock_acquire();
-  file_seek(file->file, position);
-  filesys_lock_release();
+  file_seek(file, position);
 }
 
 static unsigned tell (int fd ) {
-  struct file_wrapper *file;
+  struct file *file;
   unsigned pos;
-  file = get_file_by_fd(fd);
+  file = fd_lookup(fd);
   if (file == NULL) {
     exit(-1);
   }
-  filesys_lock_acquire();
-  pos = file_tell(file->file);
-  filesys_lock_release();
+  pos = file_tell(file);
   return pos;
 }
 
 static void close (int fd ) {
-  struct file_wrapper *file;
-  file = get_file_by_fd(fd);
+  struct file *file;
+  file = fd_remove(fd);
   if (file == NULL) {
     exit(-1);
   }
   // printf("close\n");
-  filesys_lock_acquire();
-  list_remove(&file->file_elem);
-  file_close(file->file);
-  free(file);
-  filesys_lock_release();
+  file_close(file);
 }
 
 static int write (int fd, const void *buffer, unsigned length) {
@@ -294,14 +265,12 @@ static int write (int fd, const void *buffer, unsigned length) {
     putbuf(buffer, length);
     length_write = length;
   } else {
-    struct file_wrapper *f = get_file_by_fd(fd);
+    struct file *f = fd_lookup(fd);
     if (f == NULL) {
       return -1;
     }
     // printf("write\n");
-    filesys_lock_acquire(); 
-    length_write = file_write(f->file, buffer, length);
-    filesys_lock_release();
+    length_write = file_write(f, buffer, length);
   }
   return length_write;
 }
@@ -311,12 +280,15 @@ static int write (int fd, const void *buffer, unsigned length) {
   The entire file is mapped into consecutive virtual pages starting at addr. */
 mapid_t mmap(int fd, void* addr) {
   // printf("mmap\n");
-  filesys_lock_acquire();
-  struct file* file = file_reopen(get_file_by_fd(fd)->file);
-  size_t file_size = file_length(file);
-  filesys_lock_release();
+  struct file *opened = fd_lookup(fd);
+  if (opened == NULL) {
+    return -1;
+  }
+  struct file* file = file_reopen(opened);
+  size_t file_size = file != NULL ? file_length(file) : 0;
   /* If file is not opened/not valid and filesize <= 0 then return -1*/ 
   if (file == NULL || file_size <= 0) {
+    file_close(file);
     return -1;
   }
   
@@ -324,64 +296,35 @@ mapid_t mmap(int fd, void* addr) {
     Second check: checks if address is NULL and by extension whether its virtual page 0
     Third check:  Checks if address is a user virtual address and not a kernel virtual address*/
   if (pg_ofs(addr) != 0 || addr == NULL || !is_user_vaddr(addr)) {
+    file_close(file);
     return -1;
   }
   
   /* Checks whether File descriptor passed in is 0 or 1 
     which are reserved std input and output for */
   if (fd == STDIN_FILENO || fd == STDOUT_FILENO) {
+    file_close(file);
     return -1;
   }
 
-  void* temp = addr;
   void* start_addr = addr;
-  void* end_addr = addr;
+  void* end_addr = addr + file_size;
 
-  while (file_size > 0) {
-
-    size_t read_bytes;
-    size_t zero_bytes;
-    size_t ofs = 0;
-    bool writable = true;
-
-    if (file_size >= PGSIZE) {
-      read_bytes = PGSIZE;
-      zero_bytes = 0;    
-    } else {
-      read_bytes = file_size;
-      zero_bytes = PGSIZE - file_size;
-    }
-    
-    /* Check if there already exist a loaded kpage */ 
-    uint8_t *kpage = pagedir_get_page (thread_current()->pagedir, temp);
-    /* If there already exist a loaded kpage 
-       then we have an overlap with an already loaded page 
-       be it a zeroed page (stack) or file page */
-    if (kpage != NULL)
-      return -1;
-
-    /* If there doesn't exist a loaded kpage it's possible that this page has been loaded lazily
-       So we need to check if there exists an entry in our Supplemental Page Table */ 
-    struct spt_entry *loaded = spt_find_addr(temp);
-    if (loaded != NULL) {
-      return -1;
-    }
+  /* The whole mapping must be in user memory */
+  if (end_addr <= start_addr || !is_user_vaddr(end_addr - 1)) {
+    file_close(file);
+    return -1;
+  }
 
-    /* Create a file SPT entry */
-    struct spt_entry *spt_page = create_file_page(file, temp, ofs, read_bytes, zero_bytes, writable, true);
-    if (spt_page == NULL)
-      return -1;
-    /* Add it to the SPT */
-    spt_add_page(&thread_current()->spt, spt_page);
-
-    /* Advance */
-    file_size -= read_bytes;
-    ofs += PGSIZE;
-    temp += PGSIZE;
-    end_addr += read_bytes;
+  /* Add the mapping as one area, its pages are loaded lazily on fault.
+     Fails if it overlaps any other area: code, data, stack or another
+     mapping */
+  if (vma_add(addr, file_size, file, 0, file_size, true, true) == NULL) {
+    file_close(file);
+    return -1;
   }
-  /* Now that we have loaded all the pages lazily into the SPT we can create and add 
-     The Memory Mapped File to our list */
+
+  /* Create and add the Memory Mapped File to our list */
   mapid_t mapid = get_next_mapid();
   insert_mfile(mapid, file, start_addr, end_addr);
 
@@ -397,62 +340,44 @@ void munmap (mapid_t mapid) {
   }
   size_t ofs = 0;
   for (void *addr = mfile->start_addr; addr < mfile->end_addr; addr+=PGSIZE, ofs+=PGSIZE) {
-    struct spt_entry *page = spt_find_addr(addr);
-    /* Check if spt entry exists */
+    struct spt_entry *page = spt_lookup(addr);
+    /* Check if spt entry exists, pages never touched have none */
     if (page != NULL) {
       /* If it does exist then check if the page has been modified since its been added */
       if(pagedir_is_dirty(thread_current()->pagedir, addr)) {
         /* If it has been modified then write the modified page back to the file*/
-        filesys_lock_acquire();
-        file_seek(mfile->file, ofs);
-        file_write(mfile->file, page->upage, page->read_bytes);
-        filesys_lock_release();
+        file_write_at(mfile->file, page->upage, page->read_bytes, ofs);
       }
       /* Check if the page has actually been loaded into memory*/
       void *kpage = pagedir_get_page(thread_current()->pagedir, addr);
       if (kpage != NULL) {
-        /* If so then free the frame in memory that belongs to that page*/
+        /* If so then unmap it - will pagefault and exit on access - and only
+           then free the frame, so the process can never reach a freed frame*/
+        pagedir_clear_page(thread_current()->pagedir, addr);
         free_frame_from_table(kpage);
       }
-      /* Clear the page - sets not_present to true - will pagefault and exit on access*/
-      pagedir_clear_page(thread_current()->pagedir, page->upage);
+      /* An eviction of the page that cleared its PTE before it was checked
+         above may still be writing it back from the SPT entry - wait for it
+         before freeing the entry. Once the PTE is clear, no new eviction of
+         the page can start*/
+      frame_wait_evicted(page);
       /* Remove page from Supplemental Page Table*/
       spt_delete_page(&thread_current()->spt, page->upage);
+      free(page);
     }
   }
+  /* Remove the mapping's area */
+  vma_remove(vma_find(mfile->start_addr));
   /* Delete the Memory Mapped File from the list - frees the struct also*/
   delete_mfile(mfile);
 }
 
-/* Gets the next File Descriptor*/
-static int get_next_fd() {
-  static int next_fd = 2;
-  int fd;
-  fd = next_fd++;
-  return fd;
-}
-
 /* Gets the next Mapped File ID */
 static mapid_t get_next_mapid(void) {
   static mapid_t next_mapid = 0;
   return next_mapid++;
 }
 
-/* USERPROG Function, given the tid returns the thread with that tid*/
-struct file_wrapper *
-get_file_by_fd (int fd)
-{
-  struct list_elem *elem;
-  elem = list_begin (&thread_current()->opened_files);
-  while (elem != list_end (&thread_current()->opened_files)) {
-    struct file_wrapper *f = list_entry (elem, struct file_wrapper, file_elem);
-    if (f->fd == fd)
-      return f;
-    elem = list_next (elem);
-  }
-  return NULL;
-}
-
 /* Validate a user's pointer to a virtual address
   must not be
     - null pointer
@@ -469,44 +394,12 @@ bool is_vaddr(const void *uaddr)
   if (!is_user_vaddr(uaddr))
     return false;
   /* Now that we have VM checking if a kpage exists is not enough as a page could've been loaded lazily*/
-  if (pagedir_get_page(thread_current()->pagedir, uaddr) == NULL) {
-    struct spt_entry temp;
-    temp.upage = (void *) uaddr;
-    /* Therefore if it's NULL we have to check if an entry exists in the SPT
-       If there doesn't exist an entry in the SPT either then we are sure this is not
-       a valid address
+  if (pagedir_get_page(t->pagedir, uaddr) == NULL) {
+    /* Therefore if it's NULL we have to check if an entry exists in the SPT,
+       or if an area covers it and the page just hasn't been touched yet.
+       If neither then we are sure this is not a valid address
     */
-    struct hash_elem *elem = hash_find(&t->spt, &temp.hash_elem);
-    if (elem == NULL) 
-      return false;
-    
-    return true;
+    return spt_lookup(uaddr) != NULL || vma_find(uaddr) != NULL;
   }
   return true;
 }
-
-
-/* Re-entrant locking and unlocking */
-void filesys_lock_acquire() {
-  lock_acquire(&lock_filesys);
-}
-
-void filesys_lock_release() {
-  lock_release(&lock_filesys);
-}
-
-bool try_filesys_lock_acquire() {
-  if (!lock_held_by_current_thread(&lock_filesys)) {
-    lock_acquire(&lock_filesys);
-    return true;
-  }
-  return false;
-}
-
-bool try_filesys_lock_release() {
-  if (lock_held_by_current_thread(&lock_filesys)) {
-    lock_release(&lock_filesys);
-    return true;
-  }
-  return false;
-}
\ No newline at end of file
@@ -1,27 +1,92 @@
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/malloc.h"
-#include "threads/synch.h"
+#include "devices/timer.h"
+#include "filesys/file.h"
 #include "userprog/syscall.h"
 #include "vm/frame.h"
 #include "userprog/pagedir.h"
+#include "threads/vaddr.h"
 
 /* Frame table and locks*/
 static struct hash frame_table;
 static struct lock lock_on_frame;
-static struct lock lock_eviction;
+
+/* Shared page cache: frames holding read-only file pages, keyed by
+   inode and offset, so that every process mapping the same page of
+   the same executable shares one frame */
+static struct hash shared_pages;
+
+/* Signalled whenever a frame is unpinned, for threads waiting to
+   free a frame that is being written back or to map a shared frame
+   that is being loaded */
+static struct condition frame_unpinned;
 
 static struct list frames_for_eviction;
 static struct list_elem *victim_elem;
 
-static struct frame *evict_frame(void);
+/* Reserve of clean, unowned frames filled by the page-out daemon.
+   Reserve frames stay in the frame table but are linked through
+   queue_elem and are never chosen for eviction */
+static struct list reserve_frames;
+static size_t reserve_frame_cnt;
+
+/* Number of pinned frames */
+static size_t pinned_frame_cnt;
+
+/* Dirty frames that the clock found cold, waiting for the page-out
+   daemon to write them back so they can later be reclaimed clean */
+static struct list clean_queue;
+
+/* Page-out daemon state. The daemon waits on pageout_cond with
+   lock_on_frame held */
+static struct condition pageout_cond;
+static size_t low_watermark;
+static size_t high_watermark;
+static bool pageout_running;
+
+/* Page of zeros mapped read-only at demand-zero pages that have been
+   read but not yet written, so that they don't take a frame each.
+   Allocated from the kernel pool: it's never in the frame table */
+static void *zero_kpage;
+
+/* Statistics */
+static long long clean_evict_cnt;     /* Victims evicted without writeback */
+static long long dirty_evict_cnt;     /* Victims written back when evicted */
+static long long async_clean_cnt;     /* Frames cleaned by the daemon */
+static long long shared_map_cnt;      /* Faults served from the shared page cache */
+static long long zero_map_cnt;        /* Faults served by the zero page */
+static long long zero_copy_cnt;       /* Zero pages given a frame on first write */
+
+static struct frame *evict_frame(bool wait);
 static struct frame *get_next_frame_for_eviction(void);
 static void eviction_move_next(void);
 static bool remove_frame_from_table(void *page_to_delete);
 static struct frame *insert_frame_into_table(void *page_to_insert);
+static struct frame *alloc_frame(bool may_evict);
+static void discard_frame(struct frame *frame);
+static void map_frame(struct frame *frame, struct frame_mapping *m, struct thread *t,
+                      struct spt_entry *entry, bool prefetch);
+static void unmap_frame(struct frame_mapping *m);
+static struct frame *lookup_shared(struct inode *inode, off_t ofs);
+static void remove_from_eviction_list(struct frame *frame);
+static void unlink_frame(struct frame *frame);
+static void pin_frame(struct frame *frame);
+static void unpin_frame(struct frame *frame);
+static bool frame_accessed(struct frame *frame);
+static bool frame_dirty(struct frame *frame);
+static size_t free_frame_cnt(void);
+static struct frame *take_reserve_frame(void);
+static void queue_for_cleaning(struct frame *frame);
+static void clean_queued_frames(void);
+static void write_back_page(struct frame *frame);
+static void write_back_pages(struct frame *frames[], size_t cnt);
+static void set_swap_copy(struct frame *frame, size_t slot);
+static void pageout_daemon(void *aux UNUSED);
 
 
 // static bool look_through_flip_if_necessary(struct frame *vf);
@@ -39,40 +104,537 @@ unsigned hashing_function(const struct hash_elem *hash_element, void *aux UNUSED
   return hash_int((unsigned)frame->kpage);
 }
 
-/* Initialise frame table */
-void initialise_frame() {
+//orders shared page cache entries by inode, then offset
+static bool shared_less(const struct hash_elem *a_, const struct hash_elem *b_, void *aux UNUSED) {
+  const struct frame *a = hash_entry(a_, struct frame, share_elem);
+  const struct frame *b = hash_entry(b_, struct frame, share_elem);
+  return a->inode != b->inode ? a->inode < b->inode : a->ofs < b->ofs;
+}
+
+//returns hash of a shared page cache entry's inode and offset
+static unsigned shared_hash(const struct hash_elem *e, void *aux UNUSED) {
+  const struct frame *frame = hash_entry(e, struct frame, share_elem);
+  return hash_int((unsigned)frame->inode ^ (unsigned)frame->ofs);
+}
+
+/* Initialise frame table and start the page-out daemon, keeping
+   between LOW and HIGH user frames free. Both are capped at a quarter
+   of the user pool so small pools aren't emptied by the daemon */
+void initialise_frame(size_t low, size_t high) {
+  size_t max_watermark = palloc_user_free_cnt() / 4;
+
   lock_init(&lock_on_frame);
-  lock_init(&lock_eviction);
+  cond_init(&frame_unpinned);
   hash_init(&frame_table, hashing_function, less_compare_function, NULL);
+  hash_init(&shared_pages, shared_hash, shared_less, NULL);
   list_init(&frames_for_eviction);
   victim_elem = list_begin(&frames_for_eviction);
+  list_init(&reserve_frames);
+  reserve_frame_cnt = 0;
+  list_init(&clean_queue);
+  cond_init(&pageout_cond);
+  zero_kpage = palloc_get_page(PAL_ASSERT | PAL_ZERO);
+
+  high_watermark = high < max_watermark ? high : max_watermark;
+  low_watermark = low < high_watermark ? low : high_watermark;
+  if (high_watermark > 0)
+    pageout_running = thread_create("pageout", PRI_DEFAULT, pageout_daemon, NULL) != TID_ERROR;
 }
 
-/* Removes frame from table and frees the struct and frees the kpage*/
+/* Removes the current process's mapping of the frame holding
+   PAGE_TO_FREE. Frees the frame and its kpage once nothing maps it*/
 void free_frame_from_table(void* page_to_free) {
-  remove_frame_from_table(page_to_free);
-  palloc_free_page(page_to_free);
-}
-
-/* Gets a free frame, if no free frames available evicts frame and returns free frame */
-void *get_free_frame(struct spt_entry entry) {
-  void *free_page_to_obtain = palloc_get_page(PAL_USER);
-  if (free_page_to_obtain != NULL) {
-    struct frame *f = insert_frame_into_table(free_page_to_obtain);
-    f->pagedir = thread_current()->pagedir;
-    f->upage = entry.upage;
-    return f->kpage;
-  } 
-  // exit(-1);
-  // NEED TO IMPLEMENT EVICTION STRATEGY HERE
-  
-  // At the moment will never reach here
-  struct frame *f = evict_frame();
-  f->pagedir = thread_current()->pagedir;
-  f->upage = entry.upage;
+  if (remove_frame_from_table(page_to_free))
+    palloc_free_page(page_to_free);
+}
+
+/* Releases every frame mapping held by process T, clearing them from
+   its page directory and freeing frames that nothing else maps.
+   Walks only T's own frames list rather than the whole frame table.
+   Must be called before T's SPT entries are freed. */
+void free_process_frames(struct thread *t) {
+  lock_acquire(&lock_on_frame);
+  while (!list_empty(&t->frames)) {
+    struct frame_mapping *m = list_entry(list_front(&t->frames), struct frame_mapping, owner_elem);
+    struct frame *frame = m->frame;
+    /* A pinned frame is being written back, and its SPT entry is in
+       use. Eviction also takes the frame off T's list when it's done */
+    if (frame->is_pinned) {
+      cond_wait(&frame_unpinned, &lock_on_frame);
+      continue;
+    }
+    pagedir_clear_page(m->pagedir, m->upage);
+    unmap_frame(m);
+    if (frame->map_cnt == 0) {
+      unlink_frame(frame);
+      palloc_free_page(frame->kpage);
+      free(frame);
+    }
+  }
+  lock_release(&lock_on_frame);
+}
+
+/* Gets a free frame, if no free frames available evicts frame and returns free frame.
+   The frame is mapped by the current thread for ENTRY */
+void *get_free_frame(struct spt_entry *entry) {
+  struct frame_mapping *m = malloc(sizeof *m);
+  if (m == NULL)
+    return NULL;
+  struct frame *f = alloc_frame(true);
+  if (f == NULL) {
+    free(m);
+    return NULL;
+  }
+  lock_acquire(&lock_on_frame);
+  map_frame(f, m, thread_current(), entry, false);
+  lock_release(&lock_on_frame);
   return f->kpage;
 }
 
+/* Gets a free frame for ENTRY without evicting anything, for a page
+   its owner hasn't touched yet. Returns NULL unless the user pool has
+   pages to spare above the low watermark. The frame is returned pinned
+   and already outside the working set, so it is the first to go if the
+   page is never used; unpin it with frame_unpin() once it is mapped */
+void *get_free_frame_no_evict(struct spt_entry *entry) {
+  struct frame_mapping *m = malloc(sizeof *m);
+  if (m == NULL)
+    return NULL;
+  struct frame *f = alloc_frame(false);
+  if (f == NULL) {
+    free(m);
+    return NULL;
+  }
+  lock_acquire(&lock_on_frame);
+  pin_frame(f);
+  map_frame(f, m, thread_current(), entry, true);
+  lock_release(&lock_on_frame);
+  return f->kpage;
+}
+
+/* Gets the frame holding read-only file page ENTRY from the shared
+   page cache, mapping it for the current thread. If no process has the
+   page loaded yet, gets a new frame (evicting only if MAY_EVICT), adds
+   it to the cache and sets *NEEDS_LOAD: the frame is then returned
+   pinned, and other processes wait for it until the caller has read
+   the page in and called frame_unpin(), or frame_abort_load() on
+   failure */
+void *get_shared_frame(struct spt_entry *entry, bool may_evict, bool *needs_load) {
+  struct inode *inode = file_get_inode(entry->file);
+  struct frame *new_frame = NULL;
+  struct frame *f;
+
+  struct frame_mapping *m = malloc(sizeof *m);
+  if (m == NULL)
+    return NULL;
+  *needs_load = false;
+  lock_acquire(&lock_on_frame);
+  for (;;) {
+    f = lookup_shared(inode, entry->ofs);
+    if (f != NULL) {
+      /* Pinned while its first sharer reads it in */
+      if (f->is_pinned) {
+        cond_wait(&frame_unpinned, &lock_on_frame);
+        continue;
+      }
+      shared_map_cnt++;
+      break;
+    }
+    if (new_frame != NULL) {
+      f = new_frame;
+      new_frame = NULL;
+      f->inode = inode;
+      f->ofs = entry->ofs;
+      hash_insert(&shared_pages, &f->share_elem);
+      pin_frame(f);
+      *needs_load = true;
+      break;
+    }
+    lock_release(&lock_on_frame);
+    new_frame = alloc_frame(may_evict);
+    if (new_frame == NULL) {
+      free(m);
+      return NULL;
+    }
+    lock_acquire(&lock_on_frame);
+  }
+  map_frame(f, m, thread_current(), entry, !may_evict);
+  lock_release(&lock_on_frame);
+
+  /* Another process loaded the page while we were getting a frame */
+  if (new_frame != NULL)
+    discard_frame(new_frame);
+  return f->kpage;
+}
+
+/* Unpins the frame holding KPAGE */
+void frame_unpin(void *kpage) {
+  lock_acquire(&lock_on_frame);
+  struct frame *frame = get_frame_from_table(kpage);
+  if (frame != NULL && frame->is_pinned)
+    unpin_frame(frame);
+  lock_release(&lock_on_frame);
+}
+
+/* Gives up on loading a page into the frame holding KPAGE, returned
+   pinned by get_shared_frame() or get_free_frame_no_evict(): withdraws
+   it from the shared page cache so nobody else maps it, unpins it and
+   drops the current process's mapping of it */
+void frame_abort_load(void *kpage) {
+  lock_acquire(&lock_on_frame);
+  struct frame *frame = get_frame_from_table(kpage);
+  if (frame != NULL) {
+    if (frame->inode != NULL) {
+      hash_delete(&shared_pages, &frame->share_elem);
+      frame->inode = NULL;
+    }
+    if (frame->is_pinned)
+      unpin_frame(frame);
+  }
+  lock_release(&lock_on_frame);
+  free_frame_from_table(kpage);
+}
+
+/* Pins every frame mapped by process T, so that none of its pages is
+   evicted or written back while they are being shared with a forked
+   child. First waits for any eviction or writeback of T's frames in
+   progress to finish. Undo with frame_unpin_process() */
+void frame_pin_process(struct thread *t) {
+  struct list_elem *e;
+
+  lock_acquire(&lock_on_frame);
+  for (e = list_begin(&t->frames); e != list_end(&t->frames); ) {
+    struct frame_mapping *m = list_entry(e, struct frame_mapping, owner_elem);
+    if (m->frame->is_pinned) {
+      cond_wait(&frame_unpinned, &lock_on_frame);
+      e = list_begin(&t->frames);
+    } else
+      e = list_next(e);
+  }
+  for (e = list_begin(&t->frames); e != list_end(&t->frames); e = list_next(e))
+    pin_frame(list_entry(e, struct frame_mapping, owner_elem)->frame);
+  lock_release(&lock_on_frame);
+}
+
+/* Unpins every frame mapped by process T */
+void frame_unpin_process(struct thread *t) {
+  struct list_elem *e;
+
+  lock_acquire(&lock_on_frame);
+  for (e = list_begin(&t->frames); e != list_end(&t->frames); e = list_next(e))
+    unpin_frame(list_entry(e, struct frame_mapping, owner_elem)->frame);
+  lock_release(&lock_on_frame);
+}
+
+/* Waits until eviction of ENTRY's page, if in progress, has finished.
+   Eviction clears the page's PTE before writing the page back, and
+   only records where the page went once it's written, so a fault in
+   between must not load the page from ENTRY yet */
+void frame_wait_evicted(struct spt_entry *entry) {
+  lock_acquire(&lock_on_frame);
+  while (entry->is_evicting)
+    cond_wait(&frame_unpinned, &lock_on_frame);
+  lock_release(&lock_on_frame);
+}
+
+/* Maps the frame holding KPAGE, which must be pinned, for the current
+   thread's page ENTRY as well as for the processes already mapping it.
+   Returns false if out of memory */
+bool frame_share(void *kpage, struct spt_entry *entry) {
+  struct frame_mapping *m = malloc(sizeof *m);
+  if (m == NULL)
+    return false;
+  lock_acquire(&lock_on_frame);
+  struct frame *frame = get_frame_from_table(kpage);
+  ASSERT (frame != NULL && frame->is_pinned);
+  map_frame(frame, m, thread_current(), entry, false);
+  lock_release(&lock_on_frame);
+  return true;
+}
+
+/* Returns the kernel address of the shared zero page */
+void *frame_zero_page(void) {
+  return zero_kpage;
+}
+
+/* Maps the shared zero page read-only at the current thread's page
+   ENTRY. Returns false if out of memory */
+bool frame_map_zero_page(struct spt_entry *entry) {
+  if (!pagedir_set_page(thread_current()->pagedir, entry->upage, zero_kpage, false))
+    return false;
+  lock_acquire(&lock_on_frame);
+  zero_map_cnt++;
+  lock_release(&lock_on_frame);
+  return true;
+}
+
+/* Handles a write by the current thread to its copy-on-write page
+   ENTRY, mapped read-only at KPAGE: a frame shared with a forked
+   process or the zero page. If the frame is no longer shared the page
+   is simply made writable, otherwise the current thread gets a
+   private, writable copy and drops its mapping of the shared frame.
+   Returns false if out of memory. Also returns true, doing nothing, if
+   the page was evicted meanwhile; the write will then fault it back in */
+bool frame_break_cow(void *kpage, struct spt_entry *entry) {
+  struct thread *t = thread_current();
+  struct frame *frame = NULL;
+  struct frame_mapping *m = NULL;
+  struct list_elem *e;
+
+  struct frame_mapping *copy_mapping = malloc(sizeof *copy_mapping);
+  if (copy_mapping == NULL)
+    return false;
+  if (kpage != zero_kpage) {
+    lock_acquire(&lock_on_frame);
+    while ((frame = get_frame_from_table(kpage)) != NULL && frame->is_pinned)
+      cond_wait(&frame_unpinned, &lock_on_frame);
+    if (frame == NULL || pagedir_get_page(t->pagedir, entry->upage) != kpage) {
+      lock_release(&lock_on_frame);
+      free(copy_mapping);
+      return true;
+    }
+    if (frame->map_cnt == 1) {
+      pagedir_set_writable(t->pagedir, entry->upage, true);
+      lock_release(&lock_on_frame);
+      free(copy_mapping);
+      return true;
+    }
+    /* Keep the shared frame in place while it's copied */
+    pin_frame(frame);
+    lock_release(&lock_on_frame);
+  }
+
+  struct frame *copy = alloc_frame(true);
+  if (copy != NULL)
+    memcpy(copy->kpage, kpage, PGSIZE);
+
+  lock_acquire(&lock_on_frame);
+  if (frame != NULL)
+    unpin_frame(frame);
+  if (copy == NULL) {
+    lock_release(&lock_on_frame);
+    free(copy_mapping);
+    return false;
+  }
+  pagedir_clear_page(t->pagedir, entry->upage);
+  if (frame != NULL) {
+    for (e = list_begin(&frame->mappings); e != list_end(&frame->mappings); e = list_next(e))
+      if (list_entry(e, struct frame_mapping, frame_elem)->owner == t) {
+        m = list_entry(e, struct frame_mapping, frame_elem);
+        break;
+      }
+    ASSERT (m != NULL);
+    unmap_frame(m);
+    /* The other sharers may have exited while the page was copied */
+    if (frame->map_cnt == 0) {
+      unlink_frame(frame);
+      palloc_free_page(frame->kpage);
+      free(frame);
+    }
+  } else
+    zero_copy_cnt++;
+  map_frame(copy, copy_mapping, t, entry, false);
+  /* The page table already exists, as the shared frame was mapped in it */
+  pagedir_set_page(t->pagedir, entry->upage, copy->kpage, true);
+  lock_release(&lock_on_frame);
+  return true;
+}
+
+/* Prints frame table statistics */
+void frame_print_stats(void) {
+  printf("Frames: %lld clean evictions, %lld dirty evictions, "
+         "%lld cleaned in background\n",
+         clean_evict_cnt, dirty_evict_cnt, async_clean_cnt);
+  printf("Frames: %lld faults served by shared pages\n", shared_map_cnt);
+  printf("Frames: %lld faults served by the zero page, "
+         "%lld zero pages given a frame on first write\n",
+         zero_map_cnt, zero_copy_cnt);
+}
+
+/* Returns an unowned frame: a free page from the user pool, a frame
+   from the reserve or, if MAY_EVICT, an evicted frame. Without
+   MAY_EVICT, only succeeds while the pool has pages to spare above the
+   low watermark */
+static struct frame *alloc_frame(bool may_evict) {
+  if (!may_evict && palloc_user_free_cnt() <= low_watermark)
+    return NULL;
+  void *kpage = palloc_get_page(PAL_USER);
+  if (kpage != NULL) {
+    struct frame *f = insert_frame_into_table(kpage);
+    if (f == NULL)
+      palloc_free_page(kpage);
+    return f;
+  }
+  if (!may_evict)
+    return NULL;
+  /* Normally the daemon has a clean frame waiting. Only evict
+     directly if it has fallen behind */
+  struct frame *f = take_reserve_frame();
+  if (f == NULL)
+    f = evict_frame(true);
+  return f;
+}
+
+/* Frees FRAME, obtained from alloc_frame() and never mapped */
+static void discard_frame(struct frame *frame) {
+  lock_acquire(&lock_on_frame);
+  unlink_frame(frame);
+  lock_release(&lock_on_frame);
+  palloc_free_page(frame->kpage);
+  free(frame);
+}
+
+/* Returns the number of user frames that can be handed out without
+   evicting: free pages in the user pool plus the reserve.
+   Must be called with lock_on_frame held */
+static size_t free_frame_cnt() {
+  return palloc_user_free_cnt() + reserve_frame_cnt;
+}
+
+/* Removes and returns a frame from the reserve, or NULL if it's empty */
+static struct frame *take_reserve_frame() {
+  struct frame *frame = NULL;
+  lock_acquire(&lock_on_frame);
+  if (!list_empty(&reserve_frames)) {
+    frame = list_entry(list_pop_front(&reserve_frames), struct frame, queue_elem);
+    reserve_frame_cnt--;
+  }
+  lock_release(&lock_on_frame);
+  return frame;
+}
+
+/* Page-out daemon. Writes back dirty frames queued by the clock, and
+   when free frames drop below the low watermark evicts victims into
+   the reserve until the high watermark is reached. This keeps
+   eviction I/O off the page fault path */
+static void pageout_daemon(void *aux UNUSED) {
+  bool stalled = false;
+
+  lock_acquire(&lock_on_frame);
+  for (;;) {
+    if (list_empty(&clean_queue)
+        && (stalled || free_frame_cnt() >= low_watermark)) {
+      cond_wait(&pageout_cond, &lock_on_frame);
+      stalled = false;
+      continue;
+    }
+    clean_queued_frames();
+    while (free_frame_cnt() < high_watermark) {
+      lock_release(&lock_on_frame);
+      struct frame *frame = evict_frame(false);
+      lock_acquire(&lock_on_frame);
+      if (frame == NULL) {
+        /* Nothing evictable, wait for the next allocation */
+        stalled = true;
+        break;
+      }
+      list_push_back(&reserve_frames, &frame->queue_elem);
+      reserve_frame_cnt++;
+    }
+  }
+}
+
+/* Hands dirty FRAME to the page-out daemon for writeback. Pins the
+   frame so the clock skips it until it's clean.
+   Must be called with lock_on_frame held */
+static void queue_for_cleaning(struct frame *frame) {
+  pin_frame(frame);
+  list_push_back(&clean_queue, &frame->queue_elem);
+  cond_signal(&pageout_cond, &lock_on_frame);
+}
+
+/* Writes back every frame in clean_queue, leaving them mapped but
+   clean. The frames were queued by the same clock sweeps, and are
+   written in batches of up to SWAP_CLUSTER_PAGES so that their swap
+   slots are allocated together and written in one transfer. Called by
+   the daemon with lock_on_frame held, which is dropped around each
+   batch */
+static void clean_queued_frames() {
+  while (!list_empty(&clean_queue)) {
+    struct frame *batch[SWAP_CLUSTER_PAGES];
+    size_t cnt = 0;
+    size_t i;
+    while (cnt < SWAP_CLUSTER_PAGES && !list_empty(&clean_queue))
+      batch[cnt++] = list_entry(list_pop_front(&clean_queue), struct frame, queue_elem);
+    lock_release(&lock_on_frame);
+    /* Clear the dirty bits before copying so that writes made during
+       the copy dirty the page again */
+    for (i = 0; i < cnt; i++) {
+      struct list_elem *e;
+      for (e = list_begin(&batch[i]->mappings); e != list_end(&batch[i]->mappings); e = list_next(e)) {
+        struct frame_mapping *m = list_entry(e, struct frame_mapping, frame_elem);
+        pagedir_set_dirty(m->pagedir, m->upage, false);
+      }
+    }
+    write_back_pages(batch, cnt);
+    lock_acquire(&lock_on_frame);
+    for (i = 0; i < cnt; i++) {
+      async_clean_cnt++;
+      unpin_frame(batch[i]);
+    }
+  }
+}
+
+/* Writes back the CNT pinned frames in FRAMES[], at most
+   SWAP_CLUSTER_PAGES. Anonymous pages are swapped out together, so
+   that those going to the swap device are written in one transfer */
+static void write_back_pages(struct frame *frames[], size_t cnt) {
+  struct frame *anon[SWAP_CLUSTER_PAGES];
+  void *pages[SWAP_CLUSTER_PAGES];
+  size_t slots[SWAP_CLUSTER_PAGES];
+  size_t anon_cnt = 0;
+  size_t i;
+
+  for (i = 0; i < cnt; i++) {
+    struct frame_mapping *m = list_entry(list_front(&frames[i]->mappings), struct frame_mapping, frame_elem);
+    if (m->spte->is_mmap) {
+      write_back_page(frames[i]);
+    } else {
+      anon[anon_cnt] = frames[i];
+      pages[anon_cnt++] = frames[i]->kpage;
+    }
+  }
+  swap_out_cluster(pages, slots, anon_cnt);
+  for (i = 0; i < anon_cnt; i++)
+    set_swap_copy(anon[i], slots[i]);
+}
+
+/* Writes FRAME's page to its backing store: the file for mmap pages,
+   otherwise a fresh swap slot that replaces any older copy. The frame
+   must be pinned. An mmap page is only ever mapped by its one owner,
+   but an anonymous page shared copy-on-write after a fork is written
+   to swap once, and every sharer's SPT entry takes a reference to the
+   same slot */
+static void write_back_page(struct frame *frame) {
+  ASSERT (frame->is_pinned);
+
+  struct frame_mapping *m = list_entry(list_front(&frame->mappings), struct frame_mapping, frame_elem);
+  struct spt_entry *entry = m->spte;
+  if (entry->is_mmap) {
+    ASSERT (frame->map_cnt == 1);
+    /* Write from the kernel mapping since the owner may not be running*/
+    file_write_at(entry->file, frame->kpage, entry->read_bytes, entry->ofs);
+  } else {
+    set_swap_copy(frame, swap_out(frame->kpage));
+  }
+}
+
+/* Records that FRAME's page has been written to swap-slot SLOT, which
+   replaces any older copy in the SPT entry of every process mapping
+   it. The first mapping takes over the reference SLOT was allocated
+   with, and the others take one more each */
+static void set_swap_copy(struct frame *frame, size_t slot) {
+  struct list_elem *e;
+  for (e = list_begin(&frame->mappings); e != list_end(&frame->mappings); e = list_next(e)) {
+    struct spt_entry *entry = list_entry(e, struct frame_mapping, frame_elem)->spte;
+    if (e != list_begin(&frame->mappings))
+      swap_dup(slot);
+    if (entry->has_swap_copy)
+      swap_drop(entry->swap_index);
+    entry->swap_index = slot;
+    entry->has_swap_copy = true;
+  }
+}
 
 /* Helper functions for fetching, inserting and removing frames from table*/
 //add page to frame table
@@ -82,12 +644,16 @@ static struct frame *insert_frame_into_table(void *page_to_insert) {
   if (frame == NULL) {
     return NULL;
   }  
+  frame->kpage = page_to_insert;
+  frame->is_pinned = false;
+  list_init(&frame->mappings);
+  frame->map_cnt = 0;
+  frame->inode = NULL;
+  frame->ofs = 0;
   lock_acquire(&lock_on_frame);
   hash_insert(&frame_table, &frame->hash_elem);
   list_push_back(&frames_for_eviction, &frame->list_elem);
   lock_release(&lock_on_frame); 
-  frame->kpage = page_to_insert;
-  frame->is_pinned = false;
   return frame;
 }
 
@@ -102,80 +668,253 @@ struct frame *get_frame_from_table(void *page_to_retrieve) {
   return NULL;
 }
 
-//remove page from frame table
-//returns true on success
+//remove the current thread's mapping of page from frame table
+//returns true if that was the last mapping and the frame was removed,
+//false if others still map it, it isn't in the table or it has been
+//evicted from the current process meanwhile
 static bool remove_frame_from_table(void *page_to_delete) {
-  struct frame *frame = get_frame_from_table(page_to_delete);
-  if (frame == NULL)
-    return false;
+  struct frame *frame;
+  struct frame_mapping *m = NULL;
+  struct list_elem *e;
+  bool removed = false;
+
   lock_acquire(&lock_on_frame);
-  hash_delete(&frame_table, &frame->hash_elem);
-  free(frame);
+  while ((frame = get_frame_from_table(page_to_delete)) != NULL && frame->is_pinned)
+    cond_wait(&frame_unpinned, &lock_on_frame);
+  if (frame != NULL) {
+    for (e = list_begin(&frame->mappings); e != list_end(&frame->mappings); e = list_next(e))
+      if (list_entry(e, struct frame_mapping, frame_elem)->owner == thread_current()) {
+        m = list_entry(e, struct frame_mapping, frame_elem);
+        break;
+      }
+  }
+  if (m != NULL) {
+    unmap_frame(m);
+    if (frame->map_cnt == 0) {
+      unlink_frame(frame);
+      free(frame);
+      removed = true;
+    }
+  }
   lock_release(&lock_on_frame);
-  return true;
+  return removed;
 }
 
+//retrieve the frame holding page OFS of INODE from the shared page cache
+static struct frame *lookup_shared(struct inode *inode, off_t ofs) {
+  struct frame frame;
+  frame.inode = inode;
+  frame.ofs = ofs;
+  struct hash_elem *e = hash_find(&shared_pages, &frame.share_elem);
+  return e != NULL ? hash_entry(e, struct frame, share_elem) : NULL;
+}
 
-//clock second chance variant. circular linked list
-static struct frame *evict_frame() {
-  struct frame *frame_to_be_evicted = NULL;
-  
-  lock_acquire(&lock_on_frame);
-  lock_acquire(&lock_eviction);
+/* Maps FRAME for T's page ENTRY using mapping M, adding it to T's
+   frames list. A new PREFETCH frame is aged as if unreferenced for a
+   whole working set window. Must be called with lock_on_frame held */
+static void map_frame(struct frame *frame, struct frame_mapping *m, struct thread *t,
+                      struct spt_entry *entry, bool prefetch) {
+  m->owner = t;
+  m->spte = entry;
+  m->pagedir = t->pagedir;
+  m->upage = entry->upage;
+  m->frame = frame;
+  if (frame->map_cnt++ == 0) {
+    frame->last_used = timer_ticks();
+    if (prefetch)
+      frame->last_used -= WORKING_SET_TICKS + 1;
+  }
+  list_push_back(&frame->mappings, &m->frame_elem);
+  list_push_back(&t->frames, &m->owner_elem);
+  /* Wake the page-out daemon if free frames are running low */
+  if (free_frame_cnt() < low_watermark)
+    cond_signal(&pageout_cond, &lock_on_frame);
+}
 
-  if (frame_to_be_evicted == NULL) {
-		struct frame *frame = get_next_frame_for_eviction();
-    ASSERT (frame != NULL);
-    frame_to_be_evicted = frame;
+/* Removes and frees mapping M of its frame, which must not be pinned.
+   Must be called with lock_on_frame held */
+static void unmap_frame(struct frame_mapping *m) {
+  ASSERT (!m->frame->is_pinned);
+  m->frame->map_cnt--;
+  list_remove(&m->frame_elem);
+  list_remove(&m->owner_elem);
+  free(m);
+}
+
+/* Removes unmapped, unpinned FRAME from the frame table, the shared
+   page cache and the clock. Must be called with lock_on_frame held */
+static void unlink_frame(struct frame *frame) {
+  ASSERT (!frame->is_pinned);
+  ASSERT (frame->map_cnt == 0);
+  hash_delete(&frame_table, &frame->hash_elem);
+  if (frame->inode != NULL)
+    hash_delete(&shared_pages, &frame->share_elem);
+  remove_from_eviction_list(frame);
+}
+
+/* Pins FRAME so the clock skips it and nobody frees it.
+   Must be called with lock_on_frame held */
+static void pin_frame(struct frame *frame) {
+  ASSERT (!frame->is_pinned);
+  frame->is_pinned = true;
+  pinned_frame_cnt++;
+}
+
+/* Unpins FRAME, waking any thread waiting to free or map it.
+   Must be called with lock_on_frame held */
+static void unpin_frame(struct frame *frame) {
+  frame->is_pinned = false;
+  pinned_frame_cnt--;
+  cond_broadcast(&frame_unpinned, &lock_on_frame);
+}
+
+/* Returns true if any process mapping FRAME has accessed it since the
+   last call, clearing the accessed bits */
+static bool frame_accessed(struct frame *frame) {
+  bool accessed = false;
+  struct list_elem *e;
+  for (e = list_begin(&frame->mappings); e != list_end(&frame->mappings); e = list_next(e)) {
+    struct frame_mapping *m = list_entry(e, struct frame_mapping, frame_elem);
+    if (pagedir_is_accessed(m->pagedir, m->upage)) {
+      pagedir_set_accessed(m->pagedir, m->upage, false);
+      accessed = true;
+    }
   }
-  lock_release(&lock_on_frame);
-  lock_release(&lock_eviction);
-  struct spt_entry *entry = spt_find_addr(frame_to_be_evicted->upage);
-  /* If entry is read only - don't write to swap just evict - file can be read again*/
-  /* If entry is mmap - write back to file - don't write to swap */
-  /* If entry is zero page (zero-bytes = PGSIZE) - don't write to swap)*/
-  /* If page is dirty, swap out and add reference to spte that it was dirty to set it again when swapping in*/
-  if (pagedir_is_dirty(frame_to_be_evicted->pagedir, entry->upage)){
-    if (entry->is_mmap) {
-      /* If it has been modified then write the modified page back to the file*/
-      filesys_lock_acquire();
-      file_seek(entry->file, entry->ofs);
-      file_write(entry->file, entry->upage, entry->read_bytes);
-      filesys_lock_release();
-    } else {
-      entry->swap_index = swap_out(frame_to_be_evicted->kpage);
-      entry->is_swapped = true;
+  return accessed;
+}
+
+/* Returns true if any process mapping FRAME has written to it */
+static bool frame_dirty(struct frame *frame) {
+  struct list_elem *e;
+  for (e = list_begin(&frame->mappings); e != list_end(&frame->mappings); e = list_next(e)) {
+    struct frame_mapping *m = list_entry(e, struct frame_mapping, frame_elem);
+    if (pagedir_is_dirty(m->pagedir, m->upage))
+      return true;
+  }
+  return false;
+}
+
+/* Removes FRAME from frames_for_eviction, moving the clock hand on if it
+   points at FRAME. Must be called with lock_on_frame held */
+static void remove_from_eviction_list(struct frame *frame) {
+  if (victim_elem == &frame->list_elem)
+    victim_elem = list_next(victim_elem);
+  list_remove(&frame->list_elem);
+}
+
+
+//The victim's sharers and their SPT entries come straight from the
+//frame, so no hash lookups are needed to write it back or unmap it.
+//The victim is pinned rather than locked while it's written back, so
+//other faults and process exits aren't held up behind the I/O.
+//If every candidate is pinned and WAIT is true, waits for one to be
+//unpinned; otherwise returns NULL. The page-out daemon must not wait,
+//as it's the one that unpins frames queued for cleaning
+static struct frame *evict_frame(bool wait) {
+  struct frame *frame_to_be_evicted;
+  struct list_elem *e;
+
+  lock_acquire(&lock_on_frame);
+  while ((frame_to_be_evicted = get_next_frame_for_eviction()) == NULL) {
+    if (!wait || pinned_frame_cnt == 0) {
+      lock_release(&lock_on_frame);
+      return NULL;
     }
+    cond_wait(&frame_unpinned, &lock_on_frame);
+  }
+  pin_frame(frame_to_be_evicted);
+  /* Faults on the page wait until its SPT entries say where it went */
+  for (e = list_begin(&frame_to_be_evicted->mappings); e != list_end(&frame_to_be_evicted->mappings);
+       e = list_next(e))
+    list_entry(e, struct frame_mapping, frame_elem)->spte->is_evicting = true;
+  /* Withdraw a shared page so no more processes map it */
+  if (frame_to_be_evicted->inode != NULL) {
+    hash_delete(&shared_pages, &frame_to_be_evicted->share_elem);
+    frame_to_be_evicted->inode = NULL;
+  }
+  lock_release(&lock_on_frame);
+
+  /* Unmap from every sharer first so none can modify the page while it's written back*/
+  for (e = list_begin(&frame_to_be_evicted->mappings); e != list_end(&frame_to_be_evicted->mappings);
+       e = list_next(e)) {
+    struct frame_mapping *m = list_entry(e, struct frame_mapping, frame_elem);
+    pagedir_clear_page(m->pagedir, m->upage);
+  }
+  /* Read only, zero and clean file pages are just dropped - they can be read again*/
+  /* Dirty mmap pages are written back to the file, other dirty pages to swap*/
+  /* Clean pages with an up to date swap copy are dropped and reloaded from swap*/
+  bool dirty = frame_dirty(frame_to_be_evicted);
+  if (dirty)
+    write_back_page(frame_to_be_evicted);
+
+  /* Detach the frame from its sharers so their teardown won't free it */
+  lock_acquire(&lock_on_frame);
+  if (dirty)
+    dirty_evict_cnt++;
+  else
+    clean_evict_cnt++;
+  unpin_frame(frame_to_be_evicted);
+  while (!list_empty(&frame_to_be_evicted->mappings)) {
+    struct frame_mapping *m = list_entry(list_front(&frame_to_be_evicted->mappings),
+                                         struct frame_mapping, frame_elem);
+    if (!m->spte->is_mmap && m->spte->has_swap_copy)
+      m->spte->is_swapped = true;
+    m->spte->is_evicting = false;
+    unmap_frame(m);
   }
-  pagedir_clear_page(frame_to_be_evicted->pagedir, entry->upage);
+  lock_release(&lock_on_frame);
   return frame_to_be_evicted;
 }
 
 
 /* Eviction Functions*/
 
+//WSClock: sweeps the clock looking for a clean frame that hasn't been
+//referenced within the working set window. Referenced frames have their
+//age reset, and cold dirty frames are handed to the page-out daemon to
+//be cleaned rather than written back synchronously here.
+//If a full sweep finds no such frame, falls back to the least recently
+//used clean frame seen, then to a cold dirty one, then to any dirty
+//one. Returns NULL if every frame is pinned, in the reserve or not yet
+//mapped. Must be called with lock_on_frame held
 static struct frame *get_next_frame_for_eviction() {
+  if (list_empty(&frames_for_eviction))
+    return NULL;
 	if (victim_elem == NULL || victim_elem == list_end(&frames_for_eviction)) {
   	victim_elem = list_begin(&frames_for_eviction);
   }
-  //get frame struct from frame list
-  struct frame *victim_frame;
-  bool found = false;
-  while (!found) {
-    victim_frame = list_entry(victim_elem, struct frame, list_elem);
-    if (victim_frame->is_pinned) {
-      eviction_move_next();
+  int64_t now = timer_ticks();
+  struct frame *oldest_clean = NULL;
+  struct frame *cold_dirty = NULL;
+  struct frame *any_dirty = NULL;
+  size_t scans_left = list_size(&frames_for_eviction);
+  while (scans_left-- > 0) {
+    struct frame *victim_frame = list_entry(victim_elem, struct frame, list_elem);
+    eviction_move_next();
+    if (victim_frame->is_pinned || victim_frame->map_cnt == 0) {
       continue;
     }
-    if (pagedir_is_accessed(victim_frame->pagedir, victim_frame->upage)) {
-      pagedir_set_accessed(victim_frame->pagedir, victim_frame->upage, false);
-      eviction_move_next();
-      continue;
+    if (frame_accessed(victim_frame)) {
+      victim_frame->last_used = now;
+    }
+    bool cold = now - victim_frame->last_used > WORKING_SET_TICKS;
+    if (!frame_dirty(victim_frame)) {
+      if (cold)
+        return victim_frame;
+      if (oldest_clean == NULL || victim_frame->last_used < oldest_clean->last_used)
+        oldest_clean = victim_frame;
+    } else if (cold) {
+      if (pageout_running)
+        queue_for_cleaning(victim_frame);
+      else if (cold_dirty == NULL)
+        cold_dirty = victim_frame;
+    } else if (any_dirty == NULL) {
+      any_dirty = victim_frame;
     }
-    found = true;
   }
-  // return victim_frame;
-  return victim_frame;
+  if (oldest_clean != NULL)
+    return oldest_clean;
+  return cold_dirty != NULL ? cold_dirty : any_dirty;
 }
 
 /* move position of next in frames_for_eviction */
@@ -186,25 +925,22 @@ static void eviction_move_next() {
   } 
 }
 
-/* Algorithm
-1. We have a circular list of frames with all their reference bits initialised to 0
-2. Have a pointer to a victim frame initially - arbitrary - can use the first element
-3. On a page fault, when accessing a page we load it into a free frame and set the reference bit to 1
-4. If there are no more free frames left then we start the eviction algorithm
-5. We begin with the victim frame. If victim frame has a reference bit set to 0 
-   then we swap_out the page the frame currently holds 
-6. save the swap index in the spt_entry for that page that was swapped out and set the is_swapped bool to true
-7. Return the frame that was freed to be allocated to the page that originally faulted and repeat step 3
-8. If a page fault occurs on a page that's currently swapped then use swap_in passing the spt_entries swap index
-  and the kpage of the frame you want to load it to.
+/* Algorithm (WSClock)
+1. We have a circular list of frames, each with the timer tick at which it was last seen referenced
+2. The clock hand starts at an arbitrary frame and moves on past every frame it looks at
+3. A frame whose accessed bit is set has the bit cleared and its last-used tick reset to now
+4. A frame not referenced for WORKING_SET_TICKS is outside the working set (cold)
+5. A cold, clean frame is evicted straight away: its page can be reloaded from the file,
+   re-zeroed or read back from the swap copy it still has
+6. A cold, dirty frame is pinned and queued for the page-out daemon, which writes it back
+   while it stays mapped and then clears its dirty bit, so a later sweep can take it clean
+7. If a whole sweep finds no cold clean frame, the least recently used clean frame is taken,
+   and failing that a dirty one is written back synchronously
+8. Pages read in from swap keep their swap slot, so evicting them again while clean costs no I/O
+9. A frame holding a read-only executable page may be mapped by several processes. It counts as
+   referenced or dirty if any of them referenced or dirtied it, and eviction unmaps it from all of them
 
 Note: 
-If a page has been selected for eviction but is dirty then we pin it and move to the next
 If a file is read-only (writable == false) then don't write to swap as it can be loaded again from file
 
 */
-
-
-
-
-
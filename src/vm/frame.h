@@ -8,22 +8,62 @@
 #include "vm/page.h"
 #include "devices/swap.h"
 
+/* Free user frame watermarks used by the page-out daemon unless
+   overridden with the -lowat and -hiwat kernel command-line options.
+   The daemon wakes when free frames drop below the low watermark and
+   cleans frames until there are at least the high watermark free */
+#define FRAME_DEFAULT_LOW_WATERMARK 8
+#define FRAME_DEFAULT_HIGH_WATERMARK 32
+
+/* Timer ticks since its last reference after which a frame is
+   considered to have left its owner's working set (WSClock) */
+#define WORKING_SET_TICKS 50
+
+/* One process's mapping of a frame. A frame holding a page shared
+   between processes has one mapping per sharer */
+struct frame_mapping {
+    struct thread *owner;                         // Process mapping the frame
+    struct spt_entry *spte;                       // Owner's SPT entry for the page
+    uint32_t *pagedir;                            // Owner's page directory
+    void *upage;                                  // User address the frame is mapped at
+    struct frame *frame;                          // The frame mapped
+    struct list_elem owner_elem;                  // List elem for the owner's frames list
+    struct list_elem frame_elem;                  // List elem for the frame's mappings list
+};
 
 struct frame {
     void *kpage;                                  // address of the frame's page
-    void *upage;                                 // User address that maps to  frame
-    uint32_t *pagedir;
+    struct list mappings;                         // Processes mapping the frame
+    size_t map_cnt;                               // Number of mappings (reference count)
+    struct inode *inode;                          // For a shared read-only file page, the file's
+    off_t ofs;                                    // inode and the page's offset, else NULL
     struct list_elem list_elem;                   // List elem for page eviction algorithm
+    struct list_elem queue_elem;                  // List elem for the clean queue or the reserve
     struct hash_elem hash_elem;                   // Hash entry for frame table
+    struct hash_elem share_elem;                  // Hash entry for the shared page cache
+    int64_t last_used;                            // Timer tick the page was last seen referenced
     bool is_pinned;                               // boolean check whether frame is pinned or not
 };
 
 
 bool less_compare_function(const struct hash_elem *first_hash_elem, const struct hash_elem *second_hash_elem, void *aux UNUSED);
 unsigned hashing_function(const struct hash_elem *hash_element, void *aux UNUSED);
-void initialise_frame(void);
-void *get_free_frame(struct spt_entry entry);
+void initialise_frame(size_t low_watermark, size_t high_watermark);
+void *get_free_frame(struct spt_entry *entry);
+void *get_free_frame_no_evict(struct spt_entry *entry);
+void *get_shared_frame(struct spt_entry *entry, bool may_evict, bool *needs_load);
+void frame_unpin(void *kpage);
+void frame_wait_evicted(struct spt_entry *entry);
+void frame_abort_load(void *kpage);
+void frame_pin_process(struct thread *t);
+void frame_unpin_process(struct thread *t);
+bool frame_share(void *kpage, struct spt_entry *entry);
+bool frame_break_cow(void *kpage, struct spt_entry *entry);
+void *frame_zero_page(void);
+bool frame_map_zero_page(struct spt_entry *entry);
 void free_frame_from_table(void* page);
+void free_process_frames(struct thread *t);
+void frame_print_stats(void);
 struct frame *get_frame_from_table(void *page_to_retrieve);
 
 #endif
\ No newline at end of file
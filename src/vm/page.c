@@ -4,6 +4,7 @@
 #include "threads/palloc.h"
 #include "threads/malloc.h"
 #include "vm/frame.h"
+#include "vm/vma.h"
 #include "userprog/pagedir.h"
 #include <string.h>
 #include "threads/malloc.h"
@@ -11,6 +12,16 @@
 #include "userprog/syscall.h"
 #include "devices/swap.h"
 #include "stdio.h"
+#include "filesys/file.h"
+
+static bool is_shareable(const struct spt_entry *entry);
+static bool is_demand_zero(const struct spt_entry *entry);
+static size_t swapped_run(const struct spt_entry *entry);
+static struct spt_entry *spt_from_vma(struct vma *vma, uint8_t *upage);
+
+/* Pages mapped around each file-backed page fault, including the
+   faulting page. Set with -faultaround */
+size_t fault_around_pages = FAULT_AROUND_DEFAULT_PAGES;
 
 
 
@@ -23,7 +34,9 @@ bool hash_less(const struct hash_elem *a, const struct hash_elem *b, void *aux U
    return pg_round_down(hash_entry(a, struct spt_entry, hash_elem)->upage) < pg_round_down(hash_entry(b, struct spt_entry, hash_elem)->upage);
 }
 
-struct spt_entry *spt_find_addr(const void *addr) {
+/* Returns the current process's SPT entry for the page containing
+   ADDR, or NULL if the page hasn't been touched yet */
+struct spt_entry *spt_lookup(const void *addr) {
    struct spt_entry entry;
    entry.upage = (void *)addr;
    struct hash_elem *elem = hash_find(&thread_current()->spt, &entry.hash_elem);
@@ -34,9 +47,42 @@ struct spt_entry *spt_find_addr(const void *addr) {
 
 }
 
+/* Returns the current process's SPT entry for the page containing
+   ADDR, creating it from the VMA covering ADDR on the page's first
+   touch. Returns NULL if ADDR isn't mapped, or out of memory */
+struct spt_entry *spt_find_addr(const void *addr) {
+   struct spt_entry *entry = spt_lookup(addr);
+   if (entry != NULL)
+      return entry;
+   struct vma *vma = vma_find(addr);
+   if (vma == NULL)
+      return NULL;
+   return spt_from_vma(vma, pg_round_down(addr));
+}
+
+/* Creates and adds the SPT entry for page UPAGE of VMA */
+static struct spt_entry *spt_from_vma(struct vma *vma, uint8_t *upage) {
+   size_t page_ofs = upage - vma->start;
+   size_t read_bytes = vma->read_bytes > page_ofs ? vma->read_bytes - page_ofs : 0;
+   if (read_bytes > PGSIZE)
+      read_bytes = PGSIZE;
+
+   struct spt_entry *entry;
+   if (vma->file != NULL)
+      entry = create_file_page(vma->file, upage, vma->ofs + page_ofs, read_bytes,
+                               PGSIZE - read_bytes, vma->writable, vma->is_mmap);
+   else
+      entry = create_zero_page(upage, vma->writable);
+   if (entry != NULL)
+      spt_add_page(&thread_current()->spt, entry);
+   return entry;
+}
+
 bool load_page_from_spt(struct spt_entry *entry) {
 
    ASSERT(pg_ofs (entry->upage) == 0);
+   /* Until eviction has finished, ENTRY doesn't say where the page is */
+   frame_wait_evicted(entry);
    ASSERT(entry->ofs % PGSIZE == 0);
    size_t page_read_bytes = entry->read_bytes < PGSIZE ? entry->read_bytes : PGSIZE;
    size_t page_zero_bytes = PGSIZE - page_read_bytes;
@@ -44,9 +90,25 @@ bool load_page_from_spt(struct spt_entry *entry) {
    // Check if virtual page already allocated 
    struct thread *t = thread_current ();
    uint8_t *kpage = pagedir_get_page (t->pagedir, entry->upage);
+   /* Set if kpage is a new shared frame, pinned until it's read in */
+   bool shared_load = false;
    if (kpage == NULL){
       // Get a new page of memory.
-      kpage = get_free_frame(*entry);
+      if (is_shareable(entry)) {
+         /* Read-only file pages are shared between processes */
+         bool needs_load;
+         kpage = get_shared_frame(entry, true, &needs_load);
+         if (kpage != NULL && !needs_load) {
+            if (!pagedir_set_page(t->pagedir, entry->upage, kpage, false)) {
+               free_frame_from_table(kpage);
+               return false;
+            }
+            return true;
+         }
+         shared_load = true;
+      } else {
+         kpage = get_free_frame(entry);
+      }
       if (kpage == NULL)
       {
          // Ideally this won't be the case as we will evict frames to make space
@@ -58,40 +120,233 @@ bool load_page_from_spt(struct spt_entry *entry) {
       // Add the page to the process's address space.
 
       if (!pagedir_set_page(t->pagedir, entry->upage, kpage, entry->writable)) {
-         free_frame_from_table(kpage);
+         frame_abort_load(kpage);
          return false;
       }
    } else {
-      //   Check if writable flag for the page should be updated
-      if (entry->writable && !pagedir_is_writable(t->pagedir, entry->upage)) {
-         pagedir_set_writable(t->pagedir, entry->upage, entry->writable);
-      }
+      //   A present writable page mapped read only is the zero page or
+      //   shared copy-on-write, and needs a frame of its own
+      if (entry->writable && !pagedir_is_writable(t->pagedir, entry->upage))
+         return spt_cow_fault(entry);
+      return true;
    }
    //  Load data into the page.
-   if (entry->zero_bytes == PGSIZE && !entry->is_swapped) {
+   if (is_demand_zero(entry)) {
       memset(kpage, 0, page_zero_bytes);
    } else {
       if (entry->is_swapped) {
-         swap_in (kpage, entry->swap_index);
-         pagedir_set_dirty(t->pagedir, entry->upage, true);
+         /* Keep the swap slot: until the page is dirtied again it can
+            be dropped on eviction without another swap write. The
+            following pages, if swapped out together, are read ahead */
+         swap_read_cluster (kpage, entry->swap_index, swapped_run(entry));
+         entry->is_swapped = false;
          return true;
       }
-      bool release = try_filesys_lock_acquire(); 
-      file_seek(entry->file, entry->ofs);
-      if (file_read(entry->file, kpage, page_read_bytes) != (int)page_read_bytes) {
-         if (release) {
-            filesys_lock_release();
+      if (file_read_at(entry->file, kpage, page_read_bytes, entry->ofs) != (int)page_read_bytes) {
+         if (shared_load) {
+            pagedir_clear_page(t->pagedir, entry->upage);
+            frame_abort_load(kpage);
          }
          return false;
       }
-      if (release) {
-         filesys_lock_release();
-      }
       memset(kpage + page_read_bytes, 0, page_zero_bytes);
    }
+   /* Let other processes map the page now it's read in */
+   if (shared_load)
+      frame_unpin(kpage);
    return true;
 }
 
+/* Maps the shared zero page read-only at ENTRY if it's a demand-zero
+   page, so that reading it takes no frame; the first write gets it one
+   through spt_cow_fault(). Returns false if ENTRY isn't a demand-zero
+   page or out of memory, for the caller to load it instead */
+bool spt_map_zero_page(struct spt_entry *entry) {
+   frame_wait_evicted(entry);
+   if (!is_demand_zero(entry))
+      return false;
+   return frame_map_zero_page(entry);
+}
+
+/* Returns true if ENTRY's page is all zeros and has never been written
+   out: stack pages and pages wholly in a segment's BSS */
+static bool is_demand_zero(const struct spt_entry *entry) {
+   return entry->zero_bytes == PGSIZE && !entry->is_swapped;
+}
+
+/* Returns the number of pages, at most SWAP_CLUSTER_PAGES, starting
+   with swapped out page ENTRY, that are swapped out to consecutive
+   slots at consecutive addresses of the current process */
+static size_t swapped_run(const struct spt_entry *entry) {
+   size_t cnt;
+   for (cnt = 1; cnt < SWAP_CLUSTER_PAGES; cnt++) {
+      struct spt_entry *next = spt_lookup(entry->upage + cnt * PGSIZE);
+      if (next == NULL || !next->is_swapped
+          || next->swap_index != entry->swap_index + (int) cnt)
+         break;
+   }
+   return cnt;
+}
+
+/* Returns true if ENTRY's page can be shared with other processes
+   mapping the same page of the same file: read-only pages loaded from
+   a file, such as executable text */
+static bool is_shareable(const struct spt_entry *entry) {
+   return entry->file != NULL && !entry->writable && !entry->is_mmap
+          && entry->read_bytes > 0 && !entry->is_swapped;
+}
+
+/* Maps the other not-yet-present pages in the fault-around window
+   containing ENTRY that come from the same file at the matching
+   offsets, so sequential access to executables and mmaps takes one
+   fault per window rather than per page. All the pages are read in one
+   go, and only free frames are used. The pages are mapped with their accessed bits clear and
+   their frames aged, so they are cheap to evict if never used.
+   Returns the number of pages mapped */
+int spt_fault_around(struct spt_entry *entry) {
+   struct spt_entry *pages[FAULT_AROUND_MAX_PAGES];
+   uint8_t *kpages[FAULT_AROUND_MAX_PAGES];
+   bool loaded[FAULT_AROUND_MAX_PAGES];
+   struct thread *t = thread_current ();
+   size_t cnt = 0;
+   size_t i;
+   int mapped = 0;
+
+   if (entry->file == NULL || fault_around_pages <= 1)
+      return 0;
+
+   /* Collect the candidate pages, allocating a frame for each. Pages
+      not touched yet are only considered in the faulting page's area */
+   struct vma *vma = vma_find(entry->upage);
+   uint8_t *start = entry->upage - (pg_no (entry->upage) % fault_around_pages) * PGSIZE;
+   for (i = 0; i < fault_around_pages; i++) {
+      uint8_t *upage = start + i * PGSIZE;
+      if (upage == entry->upage || !is_user_vaddr (upage))
+         continue;
+      struct spt_entry *page = spt_lookup(upage);
+      if (page == NULL && vma != NULL && upage >= vma->start && upage < vma->end)
+         page = spt_from_vma(vma, upage);
+      if (page == NULL || page->file != entry->file || page->is_swapped
+          || page->read_bytes == 0 || page->ofs != entry->ofs + (upage - entry->upage)
+          || pagedir_get_page (t->pagedir, upage) != NULL || page->is_evicting)
+         continue;
+      uint8_t *kpage;
+      if (is_shareable(page)) {
+         /* Already loaded by another process: just map it */
+         bool needs_load;
+         kpage = get_shared_frame(page, false, &needs_load);
+         if (kpage != NULL && !needs_load) {
+            if (pagedir_set_page(t->pagedir, upage, kpage, false))
+               mapped++;
+            else
+               free_frame_from_table(kpage);
+            continue;
+         }
+      } else {
+         kpage = get_free_frame_no_evict(page);
+      }
+      if (kpage == NULL)
+         break;
+      pages[cnt] = page;
+      kpages[cnt] = kpage;
+      cnt++;
+   }
+   if (cnt == 0)
+      return mapped;
+
+   /* Read them all in one go */
+   for (i = 0; i < cnt; i++) {
+      size_t page_read_bytes = pages[i]->read_bytes < PGSIZE ? pages[i]->read_bytes : PGSIZE;
+      loaded[i] = file_read_at(pages[i]->file, kpages[i], page_read_bytes, pages[i]->ofs)
+                  == (int) page_read_bytes;
+      if (loaded[i])
+         memset(kpages[i] + page_read_bytes, 0, PGSIZE - page_read_bytes);
+   }
+
+   /* Map them. A page is unpinned only once it is mapped, so that the
+      clock sees its accessed and dirty bits */
+   for (i = 0; i < cnt; i++) {
+      if (loaded[i] && pagedir_set_page(t->pagedir, pages[i]->upage, kpages[i], pages[i]->writable)) {
+         frame_unpin(kpages[i]);
+         mapped++;
+      } else {
+         frame_abort_load(kpages[i]);
+      }
+   }
+   return mapped;
+}
+
+/* Copies the address space of PARENT, which must be blocked, into the
+   current process, whose exec_file must already be open. Its VMAs are
+   copied, and so are its SPT entries, sharing any swap slot. Pages
+   PARENT has resident are shared with it copy-on-write: both processes
+   map the same frame read-only, and spt_cow_fault() copies it on the
+   first write. Memory-mapped files aren't inherited. Returns false if
+   out of memory */
+bool spt_fork(struct thread *parent) {
+   struct thread *t = thread_current ();
+   struct hash_iterator i;
+   bool success = true;
+
+   if (!vma_fork(parent))
+      return false;
+
+   /* Keep PARENT's pages in place while they are shared */
+   frame_pin_process(parent);
+   hash_first(&i, &parent->spt);
+   while (hash_next(&i)) {
+      struct spt_entry *entry = hash_entry(hash_cur(&i), struct spt_entry, hash_elem);
+      if (entry->is_mmap)
+         continue;
+      struct spt_entry *copy = malloc(sizeof *copy);
+      if (copy == NULL) {
+         success = false;
+         break;
+      }
+      *copy = *entry;
+      if (copy->file == parent->exec_file)
+         copy->file = t->exec_file;
+      if (copy->has_swap_copy)
+         swap_dup(copy->swap_index);
+      spt_add_page(&t->spt, copy);
+
+      uint8_t *kpage = pagedir_get_page(parent->pagedir, entry->upage);
+      if (kpage == NULL)
+         continue;
+      if (kpage == frame_zero_page()) {
+         if (!frame_map_zero_page(copy)) {
+            success = false;
+            break;
+         }
+         continue;
+      }
+      if (!frame_share(kpage, copy)
+          || !pagedir_set_page(t->pagedir, copy->upage, kpage, false)) {
+         success = false;
+         break;
+      }
+      /* A page newer than its backing store must still be written back
+         if the child is the one to keep it */
+      pagedir_set_dirty(t->pagedir, copy->upage, pagedir_is_dirty(parent->pagedir, entry->upage));
+      pagedir_set_writable(parent->pagedir, entry->upage, false);
+   }
+   frame_unpin_process(parent);
+   return success;
+}
+
+/* Handles a write to ENTRY, a writable page that is present but mapped
+   read-only because it is shared copy-on-write with a forked process.
+   Returns false if out of memory */
+bool spt_cow_fault(struct spt_entry *entry) {
+   uint8_t *kpage = pagedir_get_page (thread_current ()->pagedir, entry->upage);
+
+   /* If the page has been evicted since the fault, the write will
+      fault it back in */
+   if (kpage == NULL)
+      return true;
+   return frame_break_cow(kpage, entry);
+}
+
 struct spt_entry *spt_add_page(struct hash *spt, struct spt_entry *entry) {  
    struct hash_elem *old = hash_insert(spt, &entry->hash_elem);
    if (old != NULL)
@@ -103,7 +358,7 @@ struct spt_entry *spt_add_page(struct hash *spt, struct spt_entry *entry) {
 
 bool spt_delete_page(struct hash *spt, void *page)
 {
-   struct spt_entry *e = spt_find_addr(page);
+   struct spt_entry *e = spt_lookup(page);
    if (!e)
       return false;
    struct hash_elem *he = hash_delete(spt, &e->hash_elem);
@@ -130,6 +385,8 @@ struct spt_entry *create_file_page(struct file *file, void *upage,
    page->zero_bytes = zero_bytes;
    page->writable = writable;
    page->is_swapped = false;
+   page->has_swap_copy = false;
+   page->is_evicting = false;
    page->is_mmap = is_mmap;
    return page;
 }
@@ -148,6 +405,8 @@ struct spt_entry *create_zero_page(void *addr, bool writable)
    page->zero_bytes = PGSIZE;
    page->writable = writable;
    page->is_swapped = false;
+   page->has_swap_copy = false;
+   page->is_evicting = false;
    page->is_mmap = false;
    return page;
 }
\ No newline at end of file
@@ -5,6 +5,15 @@
 #include "lib/kernel/hash.h"
 #include "lib/debug.h"
 
+struct thread;
+
+/* Number of pages in the fault-around window unless overridden with
+   the -faultaround kernel command-line option, and the most allowed.
+   A window of 1 page disables fault-around */
+#define FAULT_AROUND_DEFAULT_PAGES 8
+#define FAULT_AROUND_MAX_PAGES 16
+
+extern size_t fault_around_pages;
 
 struct spt_entry {
     struct hash_elem hash_elem;
@@ -15,13 +24,20 @@ struct spt_entry {
     uint32_t zero_bytes;
     bool writable;
     int swap_index;
-    bool is_swapped;
+    bool is_swapped;      /* Not resident, load from swap_index */
+    bool has_swap_copy;   /* swap_index holds a copy of the page */
+    bool is_evicting;     /* Unmapped and being written back by eviction */
     bool is_mmap;
 };
 
 unsigned hash_func(const struct hash_elem *e, void *aux UNUSED);
 bool hash_less(const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED);
 bool load_page_from_spt(struct spt_entry *entry);
+int spt_fault_around(struct spt_entry *entry);
+bool spt_fork(struct thread *parent);
+bool spt_cow_fault(struct spt_entry *entry);
+bool spt_map_zero_page(struct spt_entry *entry);
+struct spt_entry *spt_lookup(const void *addr);
 struct spt_entry *spt_find_addr(const void *addr);
 struct spt_entry *spt_add_page(struct hash *spt, struct spt_entry *entry);
 bool spt_delete_page (struct hash *spt, void *page);
@@ -0,0 +1,118 @@
+#include "vm/vma.h"
+#include <round.h>
+#include "threads/malloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+//orders vmas by start address
+static bool vma_less(const struct list_elem *a, const struct list_elem *b, void *aux UNUSED) {
+  return list_entry(a, struct vma, elem)->start < list_entry(b, struct vma, elem)->start;
+}
+
+/* Adds an area of SIZE bytes, rounded up to whole pages, at page
+   aligned START to the current process. Its first READ_BYTES bytes are
+   read from FILE at OFS, or it is zero filled if FILE is NULL.
+   Returns the new area, or NULL if it would overlap an existing one or
+   out of memory */
+struct vma *vma_add(void *start, size_t size, struct file *file, off_t ofs,
+                    uint32_t read_bytes, bool writable, bool is_mmap) {
+  struct list *vmas = &thread_current()->vmas;
+  uint8_t *end = (uint8_t *) start + ROUND_UP(size, PGSIZE);
+  struct list_elem *e;
+
+  ASSERT (pg_ofs(start) == 0);
+  if (size == 0)
+    return NULL;
+  for (e = list_begin(vmas); e != list_end(vmas); e = list_next(e)) {
+    struct vma *other = list_entry(e, struct vma, elem);
+    if (other->start >= end)
+      break;
+    if (other->end > (uint8_t *) start)
+      return NULL;
+  }
+
+  struct vma *vma = malloc(sizeof *vma);
+  if (vma == NULL)
+    return NULL;
+  vma->start = start;
+  vma->end = end;
+  vma->file = file;
+  vma->ofs = ofs;
+  vma->read_bytes = read_bytes;
+  vma->writable = writable;
+  vma->is_mmap = is_mmap;
+  list_insert_ordered(vmas, &vma->elem, vma_less, NULL);
+  return vma;
+}
+
+/* Returns the current process's area containing ADDR, or NULL */
+struct vma *vma_find(const void *addr) {
+  struct list *vmas = &thread_current()->vmas;
+  struct list_elem *e;
+
+  for (e = list_begin(vmas); e != list_end(vmas); e = list_next(e)) {
+    struct vma *vma = list_entry(e, struct vma, elem);
+    if (vma->start > (uint8_t *) addr)
+      break;
+    if ((uint8_t *) addr < vma->end)
+      return vma;
+  }
+  return NULL;
+}
+
+/* Extends the current process's stack, the zero filled area ending at
+   PHYS_BASE, down to the page containing ADDR. Returns false if there
+   is no stack area or another area is in the way */
+bool vma_grow_stack(void *addr) {
+  struct list *vmas = &thread_current()->vmas;
+  uint8_t *upage = pg_round_down(addr);
+
+  if (list_empty(vmas))
+    return false;
+  struct vma *stack = list_entry(list_back(vmas), struct vma, elem);
+  if (stack->end != PHYS_BASE || stack->file != NULL)
+    return false;
+  if (upage >= stack->start)
+    return true;
+  if (list_prev(&stack->elem) != list_head(vmas)
+      && list_entry(list_prev(&stack->elem), struct vma, elem)->end > upage)
+    return false;
+  stack->start = upage;
+  return true;
+}
+
+/* Removes area VMA from the current process. Its pages must already
+   have been unmapped */
+void vma_remove(struct vma *vma) {
+  list_remove(&vma->elem);
+  free(vma);
+}
+
+/* Copies PARENT's areas, except memory mapped files, into the current
+   process, whose exec_file must already be open. Returns false if out
+   of memory */
+bool vma_fork(struct thread *parent) {
+  struct thread *t = thread_current();
+  struct list_elem *e;
+
+  for (e = list_begin(&parent->vmas); e != list_end(&parent->vmas); e = list_next(e)) {
+    struct vma *vma = list_entry(e, struct vma, elem);
+    if (vma->is_mmap)
+      continue;
+    struct vma *copy = malloc(sizeof *copy);
+    if (copy == NULL)
+      return false;
+    *copy = *vma;
+    if (copy->file == parent->exec_file)
+      copy->file = t->exec_file;
+    list_push_back(&t->vmas, &copy->elem);
+  }
+  return true;
+}
+
+/* Frees all of the current process's areas */
+void vma_destroy_all(void) {
+  struct list *vmas = &thread_current()->vmas;
+  while (!list_empty(vmas))
+    free(list_entry(list_pop_front(vmas), struct vma, elem));
+}
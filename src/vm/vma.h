@@ -0,0 +1,35 @@
+#ifndef VMA_H
+#define VMA_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "lib/kernel/list.h"
+#include "filesys/off_t.h"
+
+struct file;
+struct thread;
+
+/* A virtual memory area: a page aligned range [start, end) of a
+   process's address space, backed by a file or zero filled. Only the
+   range is recorded up front; SPT entries for its pages are created
+   as they are faulted in */
+struct vma {
+    uint8_t *start;             // First page of the area
+    uint8_t *end;               // Page after the last
+    struct file *file;          // Backing file, or NULL if zero filled
+    off_t ofs;                  // Offset in file of start
+    uint32_t read_bytes;        // Bytes read from file from start on, the rest are zeroed
+    bool writable;              // Whether the pages may be written
+    bool is_mmap;               // Memory mapped file, written back to file
+    struct list_elem elem;      // List elem for the owner's vmas list, sorted by start
+};
+
+struct vma *vma_add(void *start, size_t size, struct file *file, off_t ofs,
+                    uint32_t read_bytes, bool writable, bool is_mmap);
+struct vma *vma_find(const void *addr);
+bool vma_grow_stack(void *addr);
+void vma_remove(struct vma *vma);
+bool vma_fork(struct thread *parent);
+void vma_destroy_all(void);
+
+#endif